@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include <set>
 #include <thread>
+#include <vector>
 
 #include <folly/fibers/Fiber.h>
 #include <folly/fibers/FiberManager.h>
@@ -9,22 +15,18 @@
 #include <folly/io/async/EventBaseManager.h>
 #include <folly/io/async/EventHandler.h>
 #include <folly/io/async/AsyncSignalHandler.h>
-#include <folly/experimental/io/AsyncIO.h>
 #include <folly/system/ThreadName.h>
 
-#define PAGE_SIZE 4096
-
 #include "follib.h"
 #include "follib_int.h"
 #include "follib_io.h"
+#include "follib_io_engine.h"
 
 using namespace folly::fibers;
 
 using folly::EventBase;
 using folly::EventHandler;
 
-uint32_t logLevel = 2;
-
 
 static thread_local fiber_mgr *threadLocalMgr;
 
@@ -42,7 +44,7 @@ public:
 
 /*
  * This is the event handler we register for the eventfd that is used to signal
- * the end of a file i/o.
+ * the end of a file i/o, whichever engine is in use.
  */
 struct AIOEventHandler : public EventHandler {
    AIOEventHandler(EventBase *eb, int fd) : EventHandler(eb, fd) { }
@@ -52,9 +54,38 @@ struct AIOEventHandler : public EventHandler {
 
       DCHECK_EQ(events, EventHandler::READ);
 
-      auto completedOps = mgr->asyncIO->pollCompleted();
-      DCHECK_GE(completedOps.size(), 1);
+      mgr->ioEngine->pollCompleted();
+      follib_io_queue_drain(mgr);
+   }
+};
+
+/*
+ * Called by the event base at the end of every loop iteration: samples the
+ * manager's gauges. Runs on the manager's thread.
+ */
+struct follib_loop_observer : public folly::EventBaseObserver {
+   explicit follib_loop_observer(fiber_mgr *mgr) : mgr_(mgr) { }
+
+   uint32_t getSampleRate() const override {
+      return 1;
+   }
+
+   void loopSample(int64_t busyTime, int64_t idleTime) override {
+      auto c = &mgr_->counters;
+      auto manager = mgr_->manager.get();
+
+      follib_counter_add(&c->loopIterations, 1);
+      follib_counter_add(&c->busyUsec, busyTime);
+      follib_counter_add(&c->idleUsec, idleTime);
+      follib_counter_set(&c->numFibers,
+                         manager->fibersAllocated() - manager->fibersPoolSize());
+      follib_counter_set(&c->runQueueLen, manager->runQueueSize());
+      follib_counter_set(&c->ioInFlight, mgr_->ioEngine->pending());
+      follib_counter_set(&c->ioQueued, mgr_->ioQueue.numQueued);
    }
+
+ private:
+   fiber_mgr *mgr_;
 };
 
 
@@ -62,6 +93,8 @@ static struct {
    SignalEventHandler      *sigHandler;
    std::vector<fiber_mgr *> managers;
    bool                     needExit{false};
+   cpu_set_t                savedAffinity;   // of the follib_init() caller
+   bool                     pinnedCaller{false};
 } libState;
 
 
@@ -98,6 +131,26 @@ follib_get_mgr()
 }
 
 
+/*
+ * follib_get_mgr_unsafe --
+ *
+ *      Same as follib_get_mgr() but returns NULL when not called from a
+ *      manager thread.
+ */
+fiber_mgr *
+follib_get_mgr_unsafe()
+{
+   return threadLocalMgr;
+}
+
+
+fiber_mgr *
+follib_get_mgr_by_idx(uint32_t idx)
+{
+   return libState.managers.at(idx);
+}
+
+
 EventBase *
 follib_get_evb(int idx)
 {
@@ -110,27 +163,114 @@ follib_get_evb(int idx)
    return &mgr->evb;
 }
 
-static uint32_t
-get_num_cpus()
+/*
+ * A cpu a manager can be placed on.
+ */
+struct follib_cpu {
+   int cpu;
+   int node;
+};
+
+
+static int
+follib_sysfs_read_int(const char *fmt,
+                      int         cpu)
 {
-   return std::min(4u, std::thread::hardware_concurrency());
+   char path[128];
+   FILE *f;
+   int val;
+
+   snprintf(path, sizeof path, fmt, cpu);
+   f = fopen(path, "r");
+   if (!f) {
+      return -1;
+   }
+   if (fscanf(f, "%d", &val) != 1) {
+      val = -1;
+   }
+   fclose(f);
+   return val;
 }
 
 
 /*
- * Log --
+ * follib_cpu_node --
  *
- *      Log routine.
+ *      Return the NUMA node of 'cpu', i.e. the nodeN link in its sysfs
+ *      directory, or 0 on non-NUMA kernels.
  */
-void
-Log(const char *fmt,
-    ...)
+static int
+follib_cpu_node(int cpu)
 {
-   va_list ap;
+   char path[64];
+   struct dirent *de;
+   int node = 0;
+   DIR *dir;
+
+   snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+   dir = opendir(path);
+   if (!dir) {
+      return 0;
+   }
+   while ((de = readdir(dir)) != nullptr) {
+      if (sscanf(de->d_name, "node%d", &node) == 1) {
+         break;
+      }
+   }
+   closedir(dir);
+   return node;
+}
 
-   va_start(ap, fmt);
-   vprintf(fmt, ap);
-   va_end(ap);
+
+/*
+ * follib_get_cpus --
+ *
+ *      List the cpus this process may run on, in cpu order. With
+ *      'skipSmtSiblings' only the first hardware thread of each physical core
+ *      is kept.
+ */
+static std::vector<follib_cpu>
+follib_get_cpus(const cpu_set_t *allowed,
+                bool             skipSmtSiblings)
+{
+   std::set<std::pair<int, int>> cores;
+   std::vector<follib_cpu> cpus;
+
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, allowed)) {
+         continue;
+      }
+      if (skipSmtSiblings) {
+         int pkg  = follib_sysfs_read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+         int core = follib_sysfs_read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+
+         if (core >= 0 && !cores.insert(std::make_pair(pkg, core)).second) {
+            continue;
+         }
+      }
+      cpus.push_back({ cpu, follib_cpu_node(cpu) });
+   }
+   return cpus;
+}
+
+
+/*
+ * follib_pin_thread --
+ *
+ *      Bind the calling thread to 'cpu'.
+ */
+static void
+follib_pin_thread(int cpu)
+{
+   cpu_set_t set;
+   int err;
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   err = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+   if (err != 0) {
+      FLOG(0, "%s: failed to pin to cpu %d: %s\n", __func__, cpu, strerror(err));
+   }
 }
 
 
@@ -151,7 +291,7 @@ follib_run_loop_until_no_ready()
    while (mgr->manager->hasTasks()) {
       mgr->evb.loopOnce();
    }
-   FLOG(3, "thread: %u no ready tasks left.\n", mgr->idx);
+   FLOGS(FOLLIB_LOG_SCHED, 3, "thread: %u no ready tasks left.\n", mgr->idx);
 }
 
 
@@ -162,31 +302,88 @@ follib_run_loop(bool waitNoReady)
 
    mgr->evb.loopForever();
 
-   FLOG(3, "thread: %u exited loopForever (hasTasks: %u)\n",
-        mgr->idx, mgr->manager->hasTasks());
+   FLOGS(FOLLIB_LOG_SCHED, 3, "thread: %u exited loopForever (hasTasks: %u)\n",
+         mgr->idx, mgr->manager->hasTasks());
 
    if (waitNoReady) {
       follib_run_loop_until_no_ready();
    } else {
-      FLOG(1, "thread: %u: %s done.\n", mgr->idx, __func__);
+      FLOGS(FOLLIB_LOG_SCHED, 1, "thread: %u: %s done.\n", mgr->idx, __func__);
+   }
+}
+
+
+/*
+ * follib_mgr_create --
+ *
+ *      Allocate and set up a manager. This runs on the manager's own thread,
+ *      after it has been pinned, so that its memory is allocated on the local
+ *      NUMA node.
+ */
+static fiber_mgr *
+follib_mgr_create(uint32_t              idx,
+                  const follib_cpu     *cpu,
+                  const follib_options& opts)
+{
+   char threadName[16];
+   auto mgr = new fiber_mgr;
+
+   auto options = FiberManager::Options();
+   options.stackSize = opts.stackSize;
+
+   snprintf(threadName, sizeof threadName, "follib-mgr-%u", idx);
+   mgr->evb.setName(idx == 0 ? "" : threadName);
+   mgr->manager = std::make_unique<FiberManager>(std::make_unique<EventBaseLoopController>(),
+                                                 options);
+   dynamic_cast<EventBaseLoopController&>(mgr->manager->loopController())
+            .attachEventBase(mgr->evb);
+   mgr->idx = idx;
+   mgr->cpu = cpu ? cpu->cpu : -1;
+   mgr->numaNode = cpu ? cpu->node : -1;
+   mgr->ioEngine = follib_io_engine_create(opts);
+   mgr->ioQueue.maxQueued = opts.ioMaxQueued;
+   mgr->ioQueue.retry.mgr = mgr;
+   mgr->ioLatEnabled = opts.ioLatencyStats;
+   mgr->bufPool = follib_buf_pool_create(opts.bufPoolHugePages);
+   if (opts.workStealing) {
+      mgr->wsQueue = follib_ws_queue_create();
    }
+   mgr->aioEventHandler = std::make_unique<AIOEventHandler>(&mgr->evb,
+                                                            mgr->ioEngine->pollFd());
+
+   mgr->aioEventHandler->registerHandler(EventHandler::READ |
+                                         EventHandler::PERSIST);
+   mgr->loopObserver = std::make_shared<follib_loop_observer>(mgr);
+   mgr->evb.setObserver(mgr->loopObserver);
+   mgr->timer = folly::HHWheelTimer::newTimer(&mgr->evb,
+                                              std::chrono::milliseconds(opts.timerTickMs));
+   return mgr;
 }
 
 
 /*
  * follib_thread_func --
  *
- *      Each thread manager function.
+ *      Each thread manager function. 'opts' is only valid until 'ready' is
+ *      posted.
  */
 static void
-follib_thread_func(fiber_mgr *mgr)
+follib_thread_func(uint32_t              idx,
+                   const follib_cpu     *cpu,
+                   const follib_options *opts,
+                   fiber_mgr           **mgrOut,
+                   Baton                *ready)
 {
-   char threadName[16];
+   fiber_mgr *mgr;
 
+   if (cpu) {
+      follib_pin_thread(cpu->cpu);
+   }
+   mgr = follib_mgr_create(idx, cpu, *opts);
    threadLocalMgr = mgr;
 
-   snprintf(threadName, sizeof threadName, "follib-mgr-%u", mgr->idx);
-   mgr->evb.setName(threadName);
+   *mgrOut = mgr;
+   ready->post();
 
    FLOG(1, "thread: %u starting\n", mgr->idx);
 
@@ -201,45 +398,68 @@ follib_thread_func(fiber_mgr *mgr)
  * follib_init --
  *
  *      Starts multiple threads and initialize the logic required to run
- *      fibers.
+ *      fibers. 'opts' may be NULL to get the defaults.
+ *
+ *      Manager 0 is the calling thread. With 'pinThreads', manager i is bound
+ *      to the i-th usable cpu (wrapping around if there are more managers
+ *      than cpus) and sets itself up from that cpu.
  */
 void
-follib_init()
+follib_init(const follib_options *opts)
 {
-   const uint32_t numMaxAsyncIO = 32;
-   const uint32_t num_cpus = get_num_cpus();
+   const follib_options defaultOpts;
+   std::vector<follib_cpu> cpus;
+   uint32_t numThreads;
 
-   auto options = FiberManager::Options();
-   options.stackSize = 4 * PAGE_SIZE;
+   if (!opts) {
+      opts = &defaultOpts;
+   }
+
+   if (sched_getaffinity(0, sizeof libState.savedAffinity,
+                         &libState.savedAffinity) != 0) {
+      CPU_ZERO(&libState.savedAffinity);
+      for (uint32_t i = 0; i < std::thread::hardware_concurrency(); i++) {
+         CPU_SET(i, &libState.savedAffinity);
+      }
+   }
+   cpus = follib_get_cpus(&libState.savedAffinity, opts->skipSmtSiblings);
+   CHECK(!cpus.empty());
 
-   Log("%s: %u threads\n", __func__, num_cpus);
+   numThreads = opts->numThreads ? opts->numThreads : cpus.size();
 
-   for (uint32_t i = 0; i < num_cpus; i++) {
-      auto mgr = new fiber_mgr;
+   Log("%s: %u threads\n", __func__, numThreads);
 
-      mgr->evb.setName("");
-      mgr->manager = std::make_unique<FiberManager>(std::make_unique<EventBaseLoopController>(),
-                                                    options);
-      dynamic_cast<EventBaseLoopController&>(mgr->manager->loopController())
-               .attachEventBase(mgr->evb);
-      mgr->idx = i;
-      mgr->asyncIO = std::make_unique<folly::AsyncIO>(numMaxAsyncIO, folly::AsyncIO::POLLABLE);
-      mgr->aioEventHandler = std::make_unique<AIOEventHandler>(&mgr->evb,
-                                                               mgr->asyncIO->pollFd());
+   for (uint32_t i = 0; i < numThreads; i++) {
+      const follib_cpu *cpu = opts->pinThreads ? &cpus[i % cpus.size()] : nullptr;
+      fiber_mgr *mgr;
 
-      mgr->aioEventHandler->registerHandler(EventHandler::READ |
-                                            EventHandler::PERSIST);
       if (i == 0) {
+         if (cpu) {
+            follib_pin_thread(cpu->cpu);
+            libState.pinnedCaller = true;
+         }
+         mgr = follib_mgr_create(i, cpu, *opts);
+
+         Log("%s: i/o engine: %s, depth %u\n", __func__,
+             mgr->ioEngine->name(), mgr->ioEngine->capacity());
          DCHECK(!mgr->th);
          threadLocalMgr = mgr;
          libState.sigHandler = new SignalEventHandler(&mgr->evb);
          libState.sigHandler->registerSignalHandler(SIGINT);
       } else {
-         mgr->th = std::make_unique<std::thread>(follib_thread_func, mgr);
+         Baton ready;
+         auto th = std::make_unique<std::thread>(follib_thread_func, i, cpu,
+                                                 opts, &mgr, &ready);
+         ready.wait();
+         mgr->th = std::move(th);
          // wait til the poll loop is running in the new thread
          mgr->evb.waitUntilRunning();
       }
 
+      if (cpu) {
+         FLOG(1, "%s: manager %u on cpu %d node %d\n", __func__,
+              i, cpu->cpu, cpu->node);
+      }
       libState.managers.push_back(mgr);
    }
 
@@ -297,12 +517,23 @@ follib_exit()
       if (mgr->idx == 0) {
          delete libState.sigHandler;
          libState.sigHandler = nullptr;
+         threadLocalMgr = nullptr;   // later follib_buf frees go remote
+      }
+      follib_buf_pool_destroy(mgr->bufPool);
+      if (mgr->wsQueue) {
+         follib_ws_queue_destroy(mgr->wsQueue);
       }
       delete mgr;
    }
    libState.managers.clear();
    libState.needExit = false;
 
+   if (libState.pinnedCaller) {
+      pthread_setaffinity_np(pthread_self(), sizeof libState.savedAffinity,
+                             &libState.savedAffinity);
+      libState.pinnedCaller = false;
+   }
+
    Log("%s: done.\n", __func__);
 }
 
@@ -325,3 +556,82 @@ follib_get_mgr_idx()
 
    return mgr->idx;
 }
+
+
+/*
+ * follib_get_mgr_idx_unsafe --
+ *
+ *      Same as follib_get_mgr_idx() but returns -1 when not called from a
+ *      manager thread.
+ */
+int
+follib_get_mgr_idx_unsafe()
+{
+   return threadLocalMgr ? (int)threadLocalMgr->idx : -1;
+}
+
+
+/*
+ * follib_stats_remote_task --
+ *
+ *      Account for a task posted from another thread. Called by the task
+ *      itself once it runs on its manager.
+ */
+void
+follib_stats_remote_task()
+{
+   auto mgr = follib_get_mgr();
+
+   follib_counter_add(&mgr->counters.remoteTasks, 1);
+}
+
+
+/*
+ * follib_get_stats --
+ *
+ *      Snapshot the counters of every manager into 'perMgr', if not NULL (one
+ *      entry per manager), and their sum into 'total'. Safe to call from any
+ *      thread; the managers are not synchronized with so the snapshot is not
+ *      atomic across counters.
+ */
+void
+follib_get_stats(follib_mgr_stats *total,
+                 follib_mgr_stats *perMgr)
+{
+   *total = follib_mgr_stats{};
+
+   for (size_t i = 0; i < libState.managers.size(); i++) {
+      const auto c = &libState.managers[i]->counters;
+      follib_mgr_stats s;
+
+      s.loopIterations = c->loopIterations.load(std::memory_order_relaxed);
+      s.busyUsec       = c->busyUsec.load(std::memory_order_relaxed);
+      s.idleUsec       = c->idleUsec.load(std::memory_order_relaxed);
+      s.numFibers      = c->numFibers.load(std::memory_order_relaxed);
+      s.runQueueLen    = c->runQueueLen.load(std::memory_order_relaxed);
+      s.ioInFlight     = c->ioInFlight.load(std::memory_order_relaxed);
+      s.ioQueued       = c->ioQueued.load(std::memory_order_relaxed);
+      s.numReads       = c->numReads.load(std::memory_order_relaxed);
+      s.numWrites      = c->numWrites.load(std::memory_order_relaxed);
+      s.bytesRead      = c->bytesRead.load(std::memory_order_relaxed);
+      s.bytesWritten   = c->bytesWritten.load(std::memory_order_relaxed);
+      s.remoteTasks    = c->remoteTasks.load(std::memory_order_relaxed);
+
+      total->loopIterations += s.loopIterations;
+      total->busyUsec       += s.busyUsec;
+      total->idleUsec       += s.idleUsec;
+      total->numFibers      += s.numFibers;
+      total->runQueueLen    += s.runQueueLen;
+      total->ioInFlight     += s.ioInFlight;
+      total->ioQueued       += s.ioQueued;
+      total->numReads       += s.numReads;
+      total->numWrites      += s.numWrites;
+      total->bytesRead      += s.bytesRead;
+      total->bytesWritten   += s.bytesWritten;
+      total->remoteTasks    += s.remoteTasks;
+
+      if (perMgr) {
+         perMgr[i] = s;
+      }
+   }
+}
@@ -1,10 +1,44 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
 #include <folly/io/async/EventBase.h>
 #include <folly/fibers/FiberManager.h>
 #include <folly/fibers/Fiber.h>
+#include <folly/fibers/Baton.h>
+
+#include "follib_log.h"
+
+enum follib_io_backend {
+   FOLLIB_IO_BACKEND_AUTO,     // io_uring if available, libaio otherwise
+   FOLLIB_IO_BACKEND_LIBAIO,
+   FOLLIB_IO_BACKEND_URING,
+};
 
-void follib_init();
+/*
+ * Knobs for follib_init(). The defaults run one unpinned manager per usable
+ * cpu.
+ */
+struct follib_options {
+   uint32_t          numThreads{0};        // 0: one manager per usable cpu
+   bool              pinThreads{false};    // bind each manager to a cpu
+   bool              skipSmtSiblings{false}; // one cpu per physical core
+   size_t            stackSize{4 * 4096};  // fiber stack size
+   follib_io_backend ioBackend{FOLLIB_IO_BACKEND_AUTO};
+   uint32_t          ioDepth{32};          // max in-flight i/os per manager
+   uint32_t          ioMaxQueued{0};       // i/os parked beyond ioDepth, 0: no limit
+   bool              ioUringSqPoll{false}; // kernel-side sq polling thread
+   uint32_t          ioUringSqIdleMs{10};
+   bool              bufPoolHugePages{false}; // back follib_buf with MAP_HUGETLB
+   bool              workStealing{false};  // see follib_spawn_migratable()
+   bool              ioLatencyStats{true}; // see follib_io_get_latency()
+   uint32_t          timerTickMs{1};       // see follib_get_timer()
+};
+
+void follib_init(const follib_options *opts = nullptr);
 void follib_exit();
 void follib_quiesce();
 void follib_run_loop(bool waitNoReady=true);
@@ -14,10 +48,35 @@ void follib_stop_test();
 bool follib_need_exit();
 uint32_t follib_get_num_managers();
 uint32_t follib_get_mgr_idx();
+int follib_get_mgr_idx_unsafe();
 
 folly::EventBase *follib_get_evb(int idx = -1);
 folly::fibers::FiberManager *follib_get_manager(int idx = -1);
 
+/*
+ * Runtime counters of a manager, see follib_get_stats(). The gauges
+ * (numFibers, runQueueLen, ioInFlight, ioQueued) are sampled once per event
+ * loop iteration; everything else is cumulative.
+ */
+struct follib_mgr_stats {
+   uint64_t loopIterations;
+   uint64_t busyUsec;        // time spent in the loop, not waiting for events
+   uint64_t idleUsec;
+   uint64_t numFibers;       // fibers running or parked
+   uint64_t runQueueLen;     // fibers ready to run
+   uint64_t ioInFlight;      // file i/os in the engine
+   uint64_t ioQueued;        // file i/os in the admission queue
+   uint64_t numReads;
+   uint64_t numWrites;
+   uint64_t bytesRead;
+   uint64_t bytesWritten;
+   uint64_t remoteTasks;     // tasks posted from another thread
+};
+
+void follib_get_stats(follib_mgr_stats *total,
+                      follib_mgr_stats *perMgr = nullptr);
+void follib_stats_remote_task();
+
 template <typename F>
 inline void
 follib_run_in_all_managers(F&& func)
@@ -27,19 +86,170 @@ follib_run_in_all_managers(F&& func)
    for (uint32_t i = 0; i < n; i++) {
       auto manager = follib_get_manager(i);
 
-      manager->addTaskRemote(func);
+      manager->addTaskRemote([func]() mutable {
+         follib_stats_remote_task();
+         func();
+      });
+   }
+}
+
+
+/*
+ * follib_spawn_local --
+ *
+ *      Start 'numTasks' fibers running func(taskIdx) on the calling manager.
+ *      They share a single copy of 'func'.
+ */
+template <typename F>
+inline void
+follib_spawn_local(uint32_t numTasks,
+                   F&&      func)
+{
+   typedef typename std::decay<F>::type Func;
+   auto manager = follib_get_manager();
+   auto shared = std::make_shared<Func>(std::forward<F>(func));
+
+   for (uint32_t i = 0; i < numTasks; i++) {
+      manager->addTask([shared, i]() { (*shared)(i); });
+   }
+}
+
+
+/*
+ * follib_spawn_in_all_managers --
+ *
+ *      Start 'numTasks' fibers running func(taskIdx) on every manager. Unlike
+ *      calling follib_run_in_all_managers() in a loop, each manager gets one
+ *      remote task, hence one wakeup, which spawns the fibers locally. The
+ *      caller's own manager spawns them right away.
+ */
+template <typename F>
+inline void
+follib_spawn_in_all_managers(uint32_t numTasks,
+                             F&&      func)
+{
+   const uint32_t n = follib_get_num_managers();
+   const int self = follib_get_mgr_idx_unsafe();
+
+   if (numTasks == 0) {
+      return;
+   }
+   for (uint32_t i = 0; i < n; i++) {
+      if ((int)i == self) {
+         follib_spawn_local(numTasks, func);
+         continue;
+      }
+      follib_get_manager(i)->addTaskRemote([numTasks, func]() mutable {
+         follib_stats_remote_task();
+         follib_spawn_local(numTasks, std::move(func));
+      });
    }
 }
 
-extern uint32_t logLevel;
 
-void Log(const char *fmt, ...);
+/*
+ * follib_gather_all_managers --
+ *
+ *      Fan out func(taskIdx) to 'numTasks' fibers on every manager, one
+ *      wakeup per manager, and wait for all of them. Returns the results by
+ *      manager then task: result[mgrIdx * numTasks + taskIdx]. 'func' is
+ *      shared by all the managers, not copied.
+ *
+ *      Each manager counts down its own fibers and only the last fiber of
+ *      the last manager wakes the caller. Called off a fiber on a manager
+ *      thread, this runs the event loop until then, which must not happen
+ *      from inside the loop.
+ */
+template <typename F,
+          typename R = typename std::result_of<F&(uint32_t)>::type>
+inline std::vector<R>
+follib_gather_all_managers(uint32_t numTasks,
+                           F&&      func)
+{
+   const uint32_t n = follib_get_num_managers();
+   const int self = follib_get_mgr_idx_unsafe();
+   std::vector<R> results(n * numTasks);
+   std::atomic<uint32_t> remaining{n};
+   folly::fibers::Baton done;
 
+   static_assert(!std::is_same<R, bool>::value,
+                 "std::vector<bool> can't be written from several threads");
+   if (numTasks == 0) {
+      return results;
+   }
+
+   auto fanOut = [&, numTasks](uint32_t mgrIdx) {
+      auto manager = follib_get_manager();
+      folly::fibers::Baton mgrDone;
+      uint32_t left = numTasks;
+
+      for (uint32_t i = 0; i < numTasks; i++) {
+         manager->addTask([&, i]() {
+            results[mgrIdx * numTasks + i] = func(i);
+            if (--left == 0) {
+               mgrDone.post();
+            }
+         });
+      }
+      mgrDone.wait();
+      if (remaining.fetch_sub(1) == 1) {
+         done.post();
+      }
+   };
 
-#define FLOG(_lvl, _fmt, ...)    \
-   do {                          \
-      if (_lvl <= logLevel) {    \
-         Log(_fmt, __VA_ARGS__); \
-      }                          \
-   } while (0)
+   for (uint32_t i = 0; i < n; i++) {
+      if ((int)i == self) {
+         follib_get_manager()->addTask([&fanOut, i]() { fanOut(i); });
+         continue;
+      }
+      follib_get_manager(i)->addTaskRemote([&fanOut, i]() {
+         follib_stats_remote_task();
+         fanOut(i);
+      });
+   }
 
+   if (self < 0 || folly::fibers::onFiber()) {
+      done.wait();
+   } else {
+      while (!done.try_wait()) {
+         follib_run_loop_once();
+      }
+   }
+   return results;
+}
+
+
+/*
+ * follib_run_on_manager_sync --
+ *
+ *      Run 'func' on a fiber of manager 'idx' and wait for it, so that it
+ *      may park, e.g. to join other fibers. Called on that very manager off
+ *      a fiber, this runs the event loop until it's done, which must not
+ *      happen from inside the loop.
+ */
+template <typename F>
+inline void
+follib_run_on_manager_sync(uint32_t idx,
+                           F&&      func)
+{
+   folly::fibers::Baton baton;
+
+   if (follib_get_mgr_idx_unsafe() != (int)idx) {
+      follib_get_manager(idx)->addTaskRemote([&]() {
+         follib_stats_remote_task();
+         func();
+         baton.post();
+      });
+      baton.wait();
+   } else if (folly::fibers::onFiber()) {
+      func();
+   } else {
+      follib_get_manager()->addTask([&]() {
+         func();
+         baton.post();
+      });
+      while (!baton.try_wait()) {
+         follib_run_loop_once();
+      }
+   }
+}
@@ -0,0 +1,328 @@
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <folly/Memory.h>
+
+#include "follib.h"
+#include "follib_buf.h"
+#include "follib_int.h"
+
+#define PAGE_SIZE 4096
+
+/*
+ * Size classes go from 4KB to 1MB in powers of two. Each class is refilled by
+ * carving a slab, so buffers of a class are page-aligned and contiguous.
+ */
+static const uint32_t kNumClasses   = 9;
+static const size_t   kMinClassSize = PAGE_SIZE;
+static const size_t   kMaxClassSize = kMinClassSize << (kNumClasses - 1);
+static const size_t   kSlabSize     = 2 * 1024 * 1024;
+
+/*
+ * A buffer sitting on a free list. The links live in the buffer itself.
+ */
+struct follib_buf_free_node {
+   follib_buf_free_node *next;
+   uint32_t              cls;
+};
+
+struct follib_buf_slab {
+   void   *mem;
+   size_t  size;
+   bool    hugePages;
+};
+
+/*
+ * Everything but 'remoteFree' and 'orphanBytes' is only touched by the
+ * owning manager, until follib_buf_pool_destroy().
+ */
+struct follib_buf_pool {
+   follib_buf_free_node               *freeList[kNumClasses]{};
+   std::vector<follib_buf_slab>        slabs;
+   bool                                hugePages{false};
+   follib_buf_stats                    stats{};
+   std::atomic<follib_buf_free_node *> remoteFree{nullptr};
+   std::atomic<int64_t>                orphanBytes{0};   // once destroyed
+};
+
+/*
+ * 'remoteFree' of a destroyed pool whose buffers aren't all back yet.
+ */
+static follib_buf_free_node *const kPoolOrphaned =
+   reinterpret_cast<follib_buf_free_node *>(1);
+
+
+static uint32_t
+follib_buf_class(size_t size)
+{
+   uint32_t cls = 0;
+
+   while ((kMinClassSize << cls) < size) {
+      cls++;
+   }
+   return cls;
+}
+
+
+/*
+ * follib_buf_slab_alloc --
+ *
+ *      Get a slab from the system, from the hugepage pool if asked to and
+ *      available.
+ */
+static void *
+follib_buf_slab_alloc(follib_buf_pool *pool,
+                      size_t           size)
+{
+   follib_buf_slab slab = { nullptr, size, false };
+
+   if (pool->hugePages) {
+      void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (mem != MAP_FAILED) {
+         slab.mem = mem;
+         slab.hugePages = true;
+      } else {
+         FLOGS(FOLLIB_LOG_IO, 1, "%s: no hugepages left, falling back.\n", __func__);
+         pool->hugePages = false;
+      }
+   }
+   if (!slab.mem) {
+      slab.mem = folly::aligned_malloc(size, PAGE_SIZE);
+      if (!slab.mem) {
+         return nullptr;
+      }
+   }
+
+   pool->slabs.push_back(slab);
+   pool->stats.bytesReserved += size;
+   return slab.mem;
+}
+
+
+/*
+ * follib_buf_pool_refill --
+ *
+ *      Carve a new slab into buffers of class 'cls'.
+ */
+static bool
+follib_buf_pool_refill(follib_buf_pool *pool,
+                       uint32_t         cls)
+{
+   const size_t bufSize = kMinClassSize << cls;
+   const size_t slabSize = std::max(kSlabSize, bufSize);
+   uint8_t *mem;
+
+   mem = static_cast<uint8_t *>(follib_buf_slab_alloc(pool, slabSize));
+   if (!mem) {
+      return false;
+   }
+   for (size_t off = 0; off + bufSize <= slabSize; off += bufSize) {
+      auto node = reinterpret_cast<follib_buf_free_node *>(mem + off);
+
+      node->next = pool->freeList[cls];
+      node->cls = cls;
+      pool->freeList[cls] = node;
+   }
+   return true;
+}
+
+
+/*
+ * follib_buf_pool_reclaim --
+ *
+ *      Put the buffers released by other threads, taken off 'remoteFree',
+ *      back on their free list.
+ */
+static void
+follib_buf_pool_reclaim(follib_buf_pool      *pool,
+                        follib_buf_free_node *node)
+{
+   while (node) {
+      auto next = node->next;
+
+      pool->stats.bytesInUse -= kMinClassSize << node->cls;
+      pool->stats.numRemoteFrees++;
+      node->next = pool->freeList[node->cls];
+      pool->freeList[node->cls] = node;
+      node = next;
+   }
+}
+
+
+follib_buf_pool *
+follib_buf_pool_create(bool hugePages)
+{
+   auto pool = new follib_buf_pool;
+
+   pool->hugePages = hugePages;
+   return pool;
+}
+
+
+static void
+follib_buf_pool_free(follib_buf_pool *pool)
+{
+   for (auto& slab : pool->slabs) {
+      if (slab.hugePages) {
+         munmap(slab.mem, slab.size);
+      } else {
+         folly::aligned_free(slab.mem);
+      }
+   }
+   delete pool;
+}
+
+
+/*
+ * follib_buf_pool_orphan_free --
+ *
+ *      A buffer of a destroyed pool came back: free the pool with the last
+ *      one.
+ */
+static void
+follib_buf_pool_orphan_free(follib_buf_pool *pool,
+                            int64_t          bytes)
+{
+   if (pool->orphanBytes.fetch_sub(bytes, std::memory_order_acq_rel) == bytes) {
+      follib_buf_pool_free(pool);
+   }
+}
+
+
+/*
+ * follib_buf_pool_destroy --
+ *
+ *      Called by the owning manager on its way out. Buffers can outlive it,
+ *      held by another manager or by a socket that hasn't released a
+ *      WriteBuf() chain yet: the slabs then stay around until the last of
+ *      them is freed, from whatever thread.
+ */
+void
+follib_buf_pool_destroy(follib_buf_pool *pool)
+{
+   /*
+    * From now on the remote frees see kPoolOrphaned and count down
+    * 'orphanBytes' instead.
+    */
+   follib_buf_pool_reclaim(pool, pool->remoteFree.exchange(kPoolOrphaned,
+                                                           std::memory_order_acquire));
+
+   if (pool->stats.bytesInUse == 0) {
+      follib_buf_pool_free(pool);
+      return;
+   }
+   FLOGS(FOLLIB_LOG_IO, 1, "%s: %lu bytes still in use, freed with the last buffer.\n",
+         __func__, pool->stats.bytesInUse);
+   follib_buf_pool_orphan_free(pool, -(int64_t)pool->stats.bytesInUse);
+}
+
+
+/*
+ * follib_buf_alloc --
+ *
+ *      Allocate a page-aligned buffer of at least 'size' bytes from the
+ *      calling manager's pool. '*pool' receives what follib_buf_free() needs.
+ */
+void *
+follib_buf_alloc(size_t            size,
+                 follib_buf_pool **poolOut)
+{
+   follib_buf_pool *pool = follib_get_mgr()->bufPool;
+   follib_buf_free_node *node;
+   uint32_t cls;
+
+   *poolOut = pool;
+   pool->stats.numAllocs++;
+
+   if (size > kMaxClassSize) {
+      void *buf = folly::aligned_malloc(size, PAGE_SIZE);
+
+      pool->stats.numOversize++;
+      return buf;
+   }
+
+   cls = follib_buf_class(size);
+   if (pool->freeList[cls]) {
+      pool->stats.numHits++;
+   } else {
+      follib_buf_pool_reclaim(pool, pool->remoteFree.exchange(nullptr,
+                                                              std::memory_order_acquire));
+      if (pool->freeList[cls]) {
+         pool->stats.numHits++;
+      } else if (!follib_buf_pool_refill(pool, cls)) {
+         return nullptr;
+      }
+   }
+
+   node = pool->freeList[cls];
+   pool->freeList[cls] = node->next;
+
+   pool->stats.bytesInUse += kMinClassSize << cls;
+   pool->stats.bytesInUseMax = std::max(pool->stats.bytesInUseMax,
+                                        pool->stats.bytesInUse);
+   return node;
+}
+
+
+/*
+ * follib_buf_free --
+ *
+ *      Return a buffer to the pool it came from. From a foreign thread, it is
+ *      pushed on the pool's lock-free remote list and recycled by the owner
+ *      on a later miss. Once the pool is destroyed, the last buffer to come
+ *      back frees it.
+ */
+void
+follib_buf_free(follib_buf_pool *pool,
+                void            *buf,
+                size_t           size)
+{
+   auto node = static_cast<follib_buf_free_node *>(buf);
+   fiber_mgr *mgr;
+   uint32_t cls;
+
+   if (size > kMaxClassSize) {
+      folly::aligned_free(buf);
+      return;
+   }
+
+   cls = follib_buf_class(size);
+   node->cls = cls;
+
+   mgr = follib_get_mgr_unsafe();
+   if (mgr && mgr->bufPool == pool) {
+      node->next = pool->freeList[cls];
+      pool->freeList[cls] = node;
+      pool->stats.bytesInUse -= kMinClassSize << cls;
+      return;
+   }
+
+   /*
+    * bytesInUse belongs to the owner: it is fixed up when reclaiming.
+    */
+   node->next = pool->remoteFree.load(std::memory_order_relaxed);
+   do {
+      if (node->next == kPoolOrphaned) {
+         follib_buf_pool_orphan_free(pool, kMinClassSize << cls);
+         return;
+      }
+   } while (!pool->remoteFree.compare_exchange_weak(node->next, node,
+                                                    std::memory_order_release,
+                                                    std::memory_order_acquire));
+}
+
+
+/*
+ * follib_buf_get_stats --
+ *
+ *      Return the buffer pool counters of the calling manager.
+ */
+void
+follib_buf_get_stats(follib_buf_stats *stats)
+{
+   *stats = follib_get_mgr()->bufPool->stats;
+}
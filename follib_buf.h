@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct follib_buf_pool;
+
+/*
+ * Counters of a manager's buffer pool. A hit is an allocation served from a
+ * free list without going to the system allocator.
+ */
+struct follib_buf_stats {
+   uint64_t numAllocs;
+   uint64_t numHits;
+   uint64_t numOversize;      // larger than the biggest class, not pooled
+   uint64_t numRemoteFrees;   // released from another thread
+   uint64_t bytesInUse;
+   uint64_t bytesInUseMax;    // high-water mark of bytesInUse
+   uint64_t bytesReserved;    // slab memory owned by the pool
+};
+
+void *follib_buf_alloc(size_t size, follib_buf_pool **pool);
+void  follib_buf_free(follib_buf_pool *pool, void *buf, size_t size);
+void  follib_buf_get_stats(follib_buf_stats *stats);
+
+
+/*
+ * follib_buf --
+ *
+ *      Move-only handle on a page-aligned buffer from the calling manager's
+ *      pool, handed back to the pool when the handle goes away. The buffer
+ *      can be released from any thread, though doing it on the allocating
+ *      manager is cheaper. Usable as is with follib_prw():
+ *
+ *          follib_buf buf(16 * 1024);
+ *          follib_pread(fd, off, buf.size(), buf.data());
+ */
+class follib_buf {
+public:
+   follib_buf() {}
+   explicit follib_buf(size_t size)
+      : data_(follib_buf_alloc(size, &pool_)), size_(size) {}
+   ~follib_buf() { reset(); }
+
+   follib_buf(const follib_buf&) = delete;
+   follib_buf& operator=(const follib_buf&) = delete;
+
+   follib_buf(follib_buf&& other) noexcept
+      : pool_(other.pool_), data_(other.data_), size_(other.size_) {
+      other.pool_ = nullptr;
+      other.data_ = nullptr;
+      other.size_ = 0;
+   }
+   follib_buf& operator=(follib_buf&& other) noexcept {
+      if (this != &other) {
+         reset();
+         pool_ = other.pool_;
+         data_ = other.data_;
+         size_ = other.size_;
+         other.pool_ = nullptr;
+         other.data_ = nullptr;
+         other.size_ = 0;
+      }
+      return *this;
+   }
+
+   void    *data() const { return data_; }
+   size_t   size() const { return size_; }
+   explicit operator bool() const { return data_ != nullptr; }
+
+   void reset() {
+      if (data_) {
+         follib_buf_free(pool_, data_, size_);
+         pool_ = nullptr;
+         data_ = nullptr;
+         size_ = 0;
+      }
+   }
+
+private:
+   follib_buf_pool *pool_{nullptr};
+   void            *data_{nullptr};
+   size_t           size_{0};
+};
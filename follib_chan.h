@@ -0,0 +1,426 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include <folly/SpinLock.h>
+#include <folly/fibers/Baton.h>
+#include <glog/logging.h>
+
+#include "follib_sync.h"
+
+/*
+ * follib_chan --
+ *
+ *      Bounded channel carrying T's from fibers or threads of any manager to
+ *      a single receiver, typically a fiber of another manager. The ring is
+ *      Vyukov's bounded queue with a single consumer: a send is a CAS on the
+ *      tail plus a store into the slot, and nothing allocates.
+ *
+ *      A receiver that finds the ring empty raises 'recvParked_' and parks;
+ *      only the sender that lowers it again posts the receiver's baton. So
+ *      the receiver gets at most one wakeup per park, however many senders
+ *      and items pile up meanwhile, and none as long as it keeps up. Posting
+ *      to a fiber of another manager is what signals that manager's eventfd.
+ *
+ *      Senders that find the ring full park on a FIFO under a spinlock,
+ *      which the receiver only looks at when someone is on it. It wakes as
+ *      many of them as it freed slots.
+ *
+ *      close() fails the pending and future sends, and the receiver once it
+ *      has taken what's left. Only one fiber or thread may receive at a time.
+ *      T has to be default constructible and movable.
+ */
+template <typename T>
+class follib_chan {
+public:
+   explicit follib_chan(uint32_t capacity = 1024);
+
+   follib_chan(const follib_chan&) = delete;
+   follib_chan& operator=(const follib_chan&) = delete;
+
+   bool     try_send(T&& item);
+   bool     send(T item);
+   uint32_t send_batch(T *items, uint32_t numItems);
+   bool     try_recv(T *item);
+   bool     recv(T *item);
+   uint32_t recv_batch(T *items, uint32_t maxItems);
+   void     close();
+
+   bool     closed() const { return closed_.load(std::memory_order_acquire); }
+   uint32_t capacity() const { return mask_ + 1; }
+   uint64_t num_wakeups() const { return numWakeups_.load(std::memory_order_relaxed); }
+
+private:
+   struct slot {
+      std::atomic<uint64_t> seq{0};
+      T                     item;
+   };
+
+   bool push(T& item);
+   bool pop(T *item);
+   bool full() const;
+   bool empty() const;
+   void notify_recv();
+   void park_recv();
+   void park_send();
+   void wake_senders(uint32_t num);
+
+   std::unique_ptr<slot[]> slots_;
+   uint64_t                mask_{0};
+
+   char                    pad0[64];
+   std::atomic<uint64_t>   tail_{0};            // senders
+   char                    pad1[64];
+   uint64_t                head_{0};            // receiver only
+   std::atomic<bool>       recvParked_{false};
+   folly::fibers::Baton    recvBaton_;
+   std::atomic<uint64_t>   numWakeups_{0};
+   char                    pad2[64];
+   folly::SpinLock         sendLock_;           // protects sendWaiters_
+   follib_sync_queue       sendWaiters_;
+   std::atomic<uint32_t>   numSendWaiters_{0};
+   std::atomic<bool>       closed_{false};
+};
+
+
+template <typename T>
+follib_chan<T>::follib_chan(uint32_t capacity)
+{
+   uint64_t cap = 2;
+
+   while (cap < capacity) {
+      cap <<= 1;
+   }
+   slots_.reset(new slot[cap]);
+   mask_ = cap - 1;
+   for (uint64_t i = 0; i < cap; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+   }
+}
+
+
+/*
+ * follib_chan::push --
+ *
+ *      Claim the tail slot and move 'item' into it. Leaves 'item' alone if
+ *      the ring is full.
+ */
+template <typename T>
+bool
+follib_chan<T>::push(T& item)
+{
+   uint64_t pos = tail_.load(std::memory_order_relaxed);
+
+   while (true) {
+      slot *s = &slots_[pos & mask_];
+      const int64_t diff = (int64_t)(s->seq.load(std::memory_order_acquire) - pos);
+
+      if (diff == 0) {
+         if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            s->item = std::move(item);
+            s->seq.store(pos + 1, std::memory_order_release);
+            return true;
+         }
+      } else if (diff < 0) {
+         return false;
+      } else {
+         pos = tail_.load(std::memory_order_relaxed);
+      }
+   }
+}
+
+
+template <typename T>
+bool
+follib_chan<T>::pop(T *item)
+{
+   slot *s = &slots_[head_ & mask_];
+
+   if (s->seq.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+   }
+   *item = std::move(s->item);
+   s->seq.store(head_ + mask_ + 1, std::memory_order_release);
+   head_++;
+   return true;
+}
+
+
+template <typename T>
+bool
+follib_chan<T>::full() const
+{
+   const uint64_t pos = tail_.load(std::memory_order_relaxed);
+
+   return (int64_t)(slots_[pos & mask_].seq.load(std::memory_order_acquire) - pos) < 0;
+}
+
+
+template <typename T>
+bool
+follib_chan<T>::empty() const
+{
+   return slots_[head_ & mask_].seq.load(std::memory_order_acquire) != head_ + 1;
+}
+
+
+/*
+ * follib_chan::notify_recv --
+ *
+ *      Wake the receiver if it is parked. Pairs with park_recv(): either the
+ *      receiver sees what was pushed before this, or this sees it parked.
+ */
+template <typename T>
+void
+follib_chan<T>::notify_recv()
+{
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (recvParked_.load(std::memory_order_relaxed) &&
+       recvParked_.exchange(false, std::memory_order_acq_rel)) {
+      numWakeups_.fetch_add(1, std::memory_order_relaxed);
+      recvBaton_.post();
+   }
+}
+
+
+template <typename T>
+void
+follib_chan<T>::park_recv()
+{
+   recvBaton_.reset();
+   recvParked_.store(true, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+
+   if ((!empty() || closed()) &&
+       recvParked_.exchange(false, std::memory_order_acq_rel)) {
+      return;
+   }
+   /*
+    * Either nothing showed up, or a sender lowered the flag first and is
+    * about to post.
+    */
+   recvBaton_.wait();
+}
+
+
+template <typename T>
+void
+follib_chan<T>::park_send()
+{
+   follib_sync_waiter waiter;
+   bool removed;
+
+   sendLock_.lock();
+   follib_sync_queue_push(&sendWaiters_, &waiter);
+   numSendWaiters_.store(sendWaiters_.num, std::memory_order_relaxed);
+   sendLock_.unlock();
+
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (full() && !closed()) {
+      waiter.baton.wait();
+      return;
+   }
+
+   sendLock_.lock();
+   removed = follib_sync_queue_remove(&sendWaiters_, &waiter);
+   numSendWaiters_.store(sendWaiters_.num, std::memory_order_relaxed);
+   sendLock_.unlock();
+   if (!removed) {
+      waiter.baton.wait();    // popped, the post is on its way
+   }
+}
+
+
+/*
+ * follib_chan::wake_senders --
+ *
+ *      Wake up to 'num' parked senders, all of them if 'num' is 0. A waiter
+ *      may be gone as soon as it's posted.
+ */
+template <typename T>
+void
+follib_chan<T>::wake_senders(uint32_t num)
+{
+   follib_sync_waiter *head = nullptr;
+   follib_sync_waiter *tail = nullptr;
+   const bool all = num == 0;
+
+   sendLock_.lock();
+   while (sendWaiters_.num > 0 && (all || num-- > 0)) {
+      follib_sync_waiter *waiter = follib_sync_queue_pop(&sendWaiters_);
+
+      if (tail) {
+         tail->next = waiter;
+      } else {
+         head = waiter;
+      }
+      tail = waiter;
+   }
+   numSendWaiters_.store(sendWaiters_.num, std::memory_order_relaxed);
+   sendLock_.unlock();
+
+   while (head) {
+      follib_sync_waiter *next = head->next;
+
+      head->baton.post();
+      head = next;
+   }
+}
+
+
+/*
+ * follib_chan::try_send --
+ *
+ *      Send 'item' unless the ring is full or the channel closed, in which
+ *      case 'item' is left alone.
+ */
+template <typename T>
+bool
+follib_chan<T>::try_send(T&& item)
+{
+   if (closed() || !push(item)) {
+      return false;
+   }
+   notify_recv();
+   return true;
+}
+
+
+/*
+ * follib_chan::send --
+ *
+ *      Send 'item', parking while the ring is full. Fails once the channel
+ *      is closed.
+ */
+template <typename T>
+bool
+follib_chan<T>::send(T item)
+{
+   while (!closed()) {
+      if (push(item)) {
+         notify_recv();
+         return true;
+      }
+      park_send();
+   }
+   return false;
+}
+
+
+/*
+ * follib_chan::send_batch --
+ *
+ *      Move 'numItems' items in, parking while the ring is full, and wake
+ *      the receiver once rather than per item. Returns how many were sent,
+ *      fewer only if the channel got closed.
+ */
+template <typename T>
+uint32_t
+follib_chan<T>::send_batch(T        *items,
+                           uint32_t  numItems)
+{
+   uint32_t n = 0;
+
+   while (n < numItems && !closed()) {
+      if (push(items[n])) {
+         n++;
+         continue;
+      }
+      notify_recv();
+      park_send();
+   }
+   if (n > 0) {
+      notify_recv();
+   }
+   return n;
+}
+
+
+template <typename T>
+bool
+follib_chan<T>::try_recv(T *item)
+{
+   if (!pop(item)) {
+      return false;
+   }
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (numSendWaiters_.load(std::memory_order_relaxed) > 0) {
+      wake_senders(1);
+   }
+   return true;
+}
+
+
+/*
+ * follib_chan::recv --
+ *
+ *      Take the next item, parking while there is none. Fails once the
+ *      channel is closed and drained.
+ */
+template <typename T>
+bool
+follib_chan<T>::recv(T *item)
+{
+   return recv_batch(item, 1) == 1;
+}
+
+
+/*
+ * follib_chan::recv_batch --
+ *
+ *      Take up to 'maxItems' items, parking until there is at least one.
+ *      Returns 0 once the channel is closed and drained.
+ */
+template <typename T>
+uint32_t
+follib_chan<T>::recv_batch(T        *items,
+                           uint32_t  maxItems)
+{
+   uint32_t n = 0;
+
+   DCHECK_GT(maxItems, 0u);
+
+   while (true) {
+      while (n < maxItems && pop(&items[n])) {
+         n++;
+      }
+      if (n > 0 || closed()) {
+         break;
+      }
+      park_recv();
+   }
+
+   if (n > 0) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (numSendWaiters_.load(std::memory_order_relaxed) > 0) {
+         wake_senders(n);
+      }
+   } else {
+      /*
+       * Closed: a send that raced with close() may have made it in.
+       */
+      while (n < maxItems && pop(&items[n])) {
+         n++;
+      }
+   }
+   return n;
+}
+
+
+/*
+ * follib_chan::close --
+ *
+ *      Fail the parked and future sends, and wake the receiver so that it
+ *      notices once it has drained the ring.
+ */
+template <typename T>
+void
+follib_chan<T>::close()
+{
+   closed_.store(true, std::memory_order_release);
+   notify_recv();
+   wake_senders(0);
+}
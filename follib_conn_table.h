@@ -0,0 +1,365 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "follib.h"
+
+/*
+ * follib_conn_table --
+ *
+ *      Connections by fd, sharded by manager. A connection is inserted,
+ *      removed and drained by the manager it lives on, which is the only
+ *      writer of its shard, so none of this takes a lock. lookup() works from
+ *      any manager and doesn't lock either: every slot is a tiny seqlock.
+ *
+ *      Each shard is an open addressing table with linear probing and a
+ *      fixed capacity, which doubles as a per-manager connection limit. The
+ *      kernel hands out the lowest free fd, so the fd is its own hash and a
+ *      new connection usually lands right on the slot a closed one left.
+ *      Removing an entry followed by an empty slot empties it along with the
+ *      tombstones before it instead of leaving a tombstone.
+ */
+template <typename T>
+class follib_conn_table {
+public:
+   explicit follib_conn_table(uint32_t maxConnsPerMgr = 4096);
+   ~follib_conn_table();
+
+   follib_conn_table(const follib_conn_table&) = delete;
+   follib_conn_table& operator=(const follib_conn_table&) = delete;
+
+   bool               insert(int fd, std::shared_ptr<T> conn);
+   std::shared_ptr<T> remove(int fd);
+   T                 *lookup(int fd) const;
+
+   template <typename F> void for_each_local(F&& func);
+   template <typename F> void drain_local(F&& func);
+
+   uint32_t size_local() const { return local().numLive.load(std::memory_order_relaxed); }
+   uint32_t size() const;
+
+private:
+   static const int kEmpty = -1;
+   static const int kTomb  = -2;
+
+   struct slot {
+      std::atomic<uint32_t> seq{0};         // odd while being written
+      std::atomic<int>      fd{kEmpty};
+      std::atomic<T *>      ptr{nullptr};
+      std::shared_ptr<T>    ref;            // owner only
+   };
+
+   struct shard {
+      char                  pad0[64];
+      slot                 *slots{nullptr};
+      uint32_t              mask{0};
+      std::atomic<uint32_t> numLive{0};     // written by the owner only
+      char                  pad1[64];
+   };
+
+   shard&       local() { return shards_[follib_get_mgr_idx()]; }
+   const shard& local() const { return shards_[follib_get_mgr_idx()]; }
+
+   static void write_slot(slot *s, int fd, T *ptr);
+   static void read_slot(const slot *s, int *fd, T **ptr);
+   static T   *lookup_shard(const shard& sh, int fd);
+
+   shard    *shards_{nullptr};
+   uint32_t  numShards_{0};
+};
+
+
+template <typename T>
+follib_conn_table<T>::follib_conn_table(uint32_t maxConnsPerMgr)
+{
+   uint32_t cap = 16;
+   void *p;
+
+   while (cap < maxConnsPerMgr) {
+      cap <<= 1;
+   }
+
+   numShards_ = follib_get_num_managers();
+   if (posix_memalign(&p, 64, numShards_ * sizeof(shard)) != 0) {
+      throw std::bad_alloc();
+   }
+   shards_ = static_cast<shard *>(p);
+   for (uint32_t i = 0; i < numShards_; i++) {
+      new (&shards_[i]) shard();
+      shards_[i].slots = new slot[cap];
+      shards_[i].mask = cap - 1;
+   }
+}
+
+
+template <typename T>
+follib_conn_table<T>::~follib_conn_table()
+{
+   for (uint32_t i = 0; i < numShards_; i++) {
+      delete[] shards_[i].slots;
+      shards_[i].~shard();
+   }
+   free(shards_);
+}
+
+
+template <typename T>
+void
+follib_conn_table<T>::write_slot(slot *s,
+                                 int   fd,
+                                 T    *ptr)
+{
+   const uint32_t seq = s->seq.load(std::memory_order_relaxed);
+
+   s->seq.store(seq + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   s->fd.store(fd, std::memory_order_relaxed);
+   s->ptr.store(ptr, std::memory_order_relaxed);
+   s->seq.store(seq + 2, std::memory_order_release);
+}
+
+
+template <typename T>
+void
+follib_conn_table<T>::read_slot(const slot  *s,
+                                int         *fd,
+                                T          **ptr)
+{
+   while (true) {
+      const uint32_t seq = s->seq.load(std::memory_order_acquire);
+
+      *fd = s->fd.load(std::memory_order_relaxed);
+      *ptr = s->ptr.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((seq & 1) == 0 && s->seq.load(std::memory_order_relaxed) == seq) {
+         return;
+      }
+   }
+}
+
+
+/*
+ * follib_conn_table::insert --
+ *
+ *      Add 'conn' to the calling manager's shard. Fails if 'fd' is already
+ *      there or the shard is full.
+ */
+template <typename T>
+bool
+follib_conn_table<T>::insert(int                fd,
+                             std::shared_ptr<T> conn)
+{
+   shard& sh = local();
+   slot *avail = nullptr;
+
+   DCHECK_GE(fd, 0);
+
+   for (uint32_t i = 0; i <= sh.mask; i++) {
+      slot *s = &sh.slots[(fd + i) & sh.mask];
+      const int cur = s->fd.load(std::memory_order_relaxed);
+
+      if (cur == fd) {
+         return false;
+      }
+      if (cur == kTomb && !avail) {
+         avail = s;
+      } else if (cur == kEmpty) {
+         if (!avail) {
+            avail = s;
+         }
+         break;
+      }
+   }
+   if (!avail) {
+      return false;
+   }
+
+   avail->ref = std::move(conn);
+   write_slot(avail, fd, avail->ref.get());
+   sh.numLive.store(sh.numLive.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+   return true;
+}
+
+
+/*
+ * follib_conn_table::remove --
+ *
+ *      Take 'fd' out of the calling manager's shard and hand back the
+ *      table's reference, or NULL if it isn't there.
+ */
+template <typename T>
+std::shared_ptr<T>
+follib_conn_table<T>::remove(int fd)
+{
+   shard& sh = local();
+   std::shared_ptr<T> conn;
+   uint32_t idx = fd & sh.mask;
+   uint32_t i;
+
+   for (i = 0; i <= sh.mask; i++, idx = (idx + 1) & sh.mask) {
+      const int cur = sh.slots[idx].fd.load(std::memory_order_relaxed);
+
+      if (cur == fd) {
+         break;
+      }
+      if (cur == kEmpty) {
+         return nullptr;
+      }
+   }
+   if (i > sh.mask) {
+      return nullptr;
+   }
+
+   conn = std::move(sh.slots[idx].ref);
+   sh.numLive.store(sh.numLive.load(std::memory_order_relaxed) - 1,
+                    std::memory_order_relaxed);
+
+   if (sh.slots[(idx + 1) & sh.mask].fd.load(std::memory_order_relaxed) != kEmpty) {
+      write_slot(&sh.slots[idx], kTomb, nullptr);
+      return conn;
+   }
+   /*
+    * Nothing probes past an empty slot, so neither past this one nor past
+    * the tombstones right before it.
+    */
+   do {
+      write_slot(&sh.slots[idx], kEmpty, nullptr);
+      idx = (idx - 1) & sh.mask;
+   } while (sh.slots[idx].fd.load(std::memory_order_relaxed) == kTomb);
+
+   return conn;
+}
+
+
+template <typename T>
+T *
+follib_conn_table<T>::lookup_shard(const shard& sh,
+                                   int          fd)
+{
+   for (uint32_t i = 0; i <= sh.mask; i++) {
+      const slot *s = &sh.slots[(fd + i) & sh.mask];
+      int cur;
+      T *ptr;
+
+      read_slot(s, &cur, &ptr);
+      if (cur == fd) {
+         return ptr;
+      }
+      if (cur == kEmpty) {
+         break;
+      }
+   }
+   return nullptr;
+}
+
+
+/*
+ * follib_conn_table::lookup --
+ *
+ *      Find 'fd' in any shard, starting with the caller's. The connection is
+ *      only guaranteed to stay around on the manager that owns it; others
+ *      need to hold a reference of their own.
+ */
+template <typename T>
+T *
+follib_conn_table<T>::lookup(int fd) const
+{
+   const int self = follib_get_mgr_idx_unsafe();
+   T *ptr;
+
+   if (self >= 0 && (uint32_t)self < numShards_) {
+      ptr = lookup_shard(shards_[self], fd);
+      if (ptr) {
+         return ptr;
+      }
+   }
+   for (uint32_t i = 0; i < numShards_; i++) {
+      if ((int)i == self) {
+         continue;
+      }
+      ptr = lookup_shard(shards_[i], fd);
+      if (ptr) {
+         return ptr;
+      }
+   }
+   return nullptr;
+}
+
+
+/*
+ * follib_conn_table::for_each_local --
+ *
+ *      Call func(fd, conn) on every connection of the calling manager. The
+ *      callback must not insert or remove.
+ */
+template <typename T>
+template <typename F>
+void
+follib_conn_table<T>::for_each_local(F&& func)
+{
+   shard& sh = local();
+
+   for (uint32_t i = 0; i <= sh.mask; i++) {
+      slot *s = &sh.slots[i];
+      const int fd = s->fd.load(std::memory_order_relaxed);
+
+      if (fd >= 0) {
+         func(fd, s->ref);
+      }
+   }
+}
+
+
+/*
+ * follib_conn_table::drain_local --
+ *
+ *      Empty the calling manager's shard, then call func(conn) on every
+ *      connection it held. Meant for shutdown, on each manager.
+ */
+template <typename T>
+template <typename F>
+void
+follib_conn_table<T>::drain_local(F&& func)
+{
+   shard& sh = local();
+   std::vector<std::shared_ptr<T>> conns;
+
+   conns.reserve(sh.numLive.load(std::memory_order_relaxed));
+   for (uint32_t i = 0; i <= sh.mask; i++) {
+      slot *s = &sh.slots[i];
+      const int fd = s->fd.load(std::memory_order_relaxed);
+
+      if (fd >= 0) {
+         conns.push_back(std::move(s->ref));
+      }
+      if (fd != kEmpty) {
+         write_slot(s, kEmpty, nullptr);
+      }
+   }
+   sh.numLive.store(0, std::memory_order_relaxed);
+
+   for (auto& conn : conns) {
+      func(std::move(conn));
+   }
+}
+
+
+template <typename T>
+uint32_t
+follib_conn_table<T>::size() const
+{
+   uint32_t n = 0;
+
+   for (uint32_t i = 0; i < numShards_; i++) {
+      n += shards_[i].numLive.load(std::memory_order_relaxed);
+   }
+   return n;
+}
@@ -0,0 +1,299 @@
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include <folly/fibers/FiberManager.h>
+
+#include "follib.h"
+#include "follib_fib.h"
+
+/*
+ * Fib handles go back to the free list of the thread that created them, i.e.
+ * per manager, up to kFibPoolMax of them. Joined on another thread, a handle
+ * is pushed on its pool's lock-free remote list, which the owner takes back
+ * on a miss, the same way as follib_buf. Along with the fibers and their
+ * stacks that FiberManager recycles, and the task closure that addTask()
+ * builds in the fiber's own buffer as long as it is small, this makes
+ * Fiber_Create() and Fiber_Join() allocation-free in steady state, wherever
+ * the join happens.
+ *
+ * Everything but 'remoteFree' and 'orphanOut' is only touched by the owning
+ * thread. Once it has exited, the pool lives on until its last handle comes
+ * back.
+ */
+static const uint32_t kFibPoolMax = 1024;
+
+struct follib_fib_pool {
+   std::vector<Fib *>    free;
+   uint64_t              numAllocs{0};
+   uint64_t              numReused{0};
+   uint64_t              numOut{0};           // handed out, not back yet
+   std::atomic<Fib *>    remoteFree{nullptr};
+   std::atomic<int64_t>  orphanOut{0};        // once the owner exited
+};
+
+/*
+ * 'remoteFree' of a pool whose thread has exited.
+ */
+static Fib *const kFibPoolOrphaned = reinterpret_cast<Fib *>(1);
+
+
+static void
+follib_fib_pool_put(follib_fib_pool *pool,
+                    Fib             *fib)
+{
+   if (pool->free.size() >= kFibPoolMax) {
+      delete fib;
+      return;
+   }
+   pool->free.push_back(fib);
+}
+
+
+/*
+ * follib_fib_pool_reclaim --
+ *
+ *      Take back the handles joined on other threads, taken off 'remoteFree'.
+ */
+static void
+follib_fib_pool_reclaim(follib_fib_pool *pool,
+                        Fib             *fib)
+{
+   while (fib) {
+      Fib *next = fib->nextFree;
+
+      pool->numOut--;
+      follib_fib_pool_put(pool, fib);
+      fib = next;
+   }
+}
+
+
+/*
+ * follib_fib_pool_orphan_put --
+ *
+ *      A handle of an exited thread came back: free the pool with the last
+ *      one.
+ */
+static void
+follib_fib_pool_orphan_put(follib_fib_pool *pool,
+                           int64_t          n)
+{
+   if (pool->orphanOut.fetch_sub(n, std::memory_order_acq_rel) == n) {
+      delete pool;
+   }
+}
+
+
+/*
+ * The calling thread's pool, created on first use and orphaned when the
+ * thread exits.
+ */
+struct follib_fib_pool_ref {
+   ~follib_fib_pool_ref() {
+      if (!pool) {
+         return;
+      }
+      follib_fib_pool_reclaim(pool, pool->remoteFree.exchange(kFibPoolOrphaned,
+                                                              std::memory_order_acquire));
+      for (auto fib : pool->free) {
+         delete fib;
+      }
+      pool->free.clear();
+      if (pool->numOut == 0) {
+         delete pool;
+      } else {
+         follib_fib_pool_orphan_put(pool, -(int64_t)pool->numOut);
+      }
+   }
+
+   follib_fib_pool *pool{nullptr};
+};
+
+static thread_local follib_fib_pool_ref fibPoolRef;
+
+
+static follib_fib_pool *
+follib_fib_get_pool()
+{
+   if (!fibPoolRef.pool) {
+      fibPoolRef.pool = new follib_fib_pool;
+      fibPoolRef.pool->free.reserve(kFibPoolMax);
+   }
+   return fibPoolRef.pool;
+}
+
+
+static Fib *
+follib_fib_alloc()
+{
+   follib_fib_pool *pool = follib_fib_get_pool();
+   Fib *fib;
+
+   if (pool->free.empty() &&
+       pool->remoteFree.load(std::memory_order_relaxed) != nullptr) {
+      follib_fib_pool_reclaim(pool, pool->remoteFree.exchange(nullptr,
+                                                              std::memory_order_acquire));
+   }
+   if (pool->free.empty()) {
+      pool->numAllocs++;
+      fib = new Fib();
+      fib->pool = pool;
+   } else {
+      fib = pool->free.back();
+      pool->free.pop_back();
+      pool->numReused++;
+   }
+   pool->numOut++;
+   return fib;
+}
+
+
+/*
+ * follib_fib_free --
+ *
+ *      Hand a joined handle back to the pool it came from.
+ */
+static void
+follib_fib_free(Fib *fib)
+{
+   follib_fib_pool *pool = fib->pool;
+
+   if (pool == fibPoolRef.pool) {
+      pool->numOut--;
+      follib_fib_pool_put(pool, fib);
+      return;
+   }
+
+   fib->nextFree = pool->remoteFree.load(std::memory_order_relaxed);
+   do {
+      if (fib->nextFree == kFibPoolOrphaned) {
+         delete fib;
+         follib_fib_pool_orphan_put(pool, 1);
+         return;
+      }
+   } while (!pool->remoteFree.compare_exchange_weak(fib->nextFree, fib,
+                                                    std::memory_order_release,
+                                                    std::memory_order_acquire));
+}
+
+
+/*
+ * Fib::Wait --
+ *
+ *      Wait for the fiber to complete. A fiber caller parks, and a thread
+ *      blocks on the baton's futex until Complete() wakes it; either may be
+ *      on any manager but the fiber's.
+ *
+ *      The one thread that can't block is the fiber's own manager, off a
+ *      fiber: nothing would run the fiber. That only works from outside the
+ *      event loop, e.g. main() on manager 0, by running the loop until the
+ *      fiber is done. Inside a loop callback, join from a fiber instead.
+ */
+void
+Fib::Wait()
+{
+   FLOGS(FOLLIB_LOG_SCHED, 2, "-- %s:%u\n", __func__, __LINE__);
+
+   if (folly::fibers::onFiber() ||
+       follib_get_mgr_idx_unsafe() != (int)mgrIdx_) {
+      baton_.wait();
+      return;
+   }
+
+   DCHECK(!follib_get_evb()->isRunning());
+   while (!baton_.try_wait()) {
+      follib_run_loop_once();
+   }
+}
+
+
+void
+Fib::Complete(void *res)
+{
+   FLOGS(FOLLIB_LOG_SCHED, 2, "-- %s:%u\n", __func__, __LINE__);
+   result_ = res;
+   baton_.post();
+}
+
+
+/*
+ * Fiber_Create --
+ *
+ *      Start func(param) on a new fiber of the calling manager. The fiber
+ *      has to be joined with Fiber_Join().
+ */
+Fib *
+Fiber_Create(FiberRunFunc *func,
+             void         *param)
+{
+   auto mgr = follib_get_manager();
+   Fib *fib = follib_fib_alloc();
+
+   fib->Init(follib_get_mgr_idx());
+
+   FLOGS(FOLLIB_LOG_SCHED, 1, "-- %s:%u func=%p param=%p\n", __func__, __LINE__,
+         (void *)func, param);
+
+   mgr->addTask([fib, func, param]() {
+      void *res = func(param);
+      fib->Complete(res);
+   });
+
+   return fib;
+}
+
+
+/*
+ * Fiber_CreateOn --
+ *
+ *      Same as above on manager 'mgrIdx', from any thread.
+ */
+Fib *
+Fiber_CreateOn(uint32_t      mgrIdx,
+               FiberRunFunc *func,
+               void         *param)
+{
+   Fib *fib;
+
+   if (follib_get_mgr_idx_unsafe() == (int)mgrIdx) {
+      return Fiber_Create(func, param);
+   }
+
+   fib = follib_fib_alloc();
+   fib->Init(mgrIdx);
+
+   follib_get_manager(mgrIdx)->addTaskRemote([fib, func, param]() {
+      follib_stats_remote_task();
+      void *res = func(param);
+      fib->Complete(res);
+   });
+
+   return fib;
+}
+
+
+int
+Fiber_Join(Fib   *fib,
+           void **result)
+{
+   FLOGS(FOLLIB_LOG_SCHED, 2, "-- %s:%u\n", __func__, __LINE__);
+   fib->Wait();
+
+   if (result) {
+      *result = fib->GetResult();
+   }
+   follib_fib_free(fib);
+   return 0;
+}
+
+
+void
+Fiber_GetPoolStats(follib_fib_pool_stats *stats)
+{
+   follib_fib_pool *pool = follib_fib_get_pool();
+
+   stats->numAllocs = pool->numAllocs;
+   stats->numReused = pool->numReused;
+   stats->numPooled = pool->free.size();
+}
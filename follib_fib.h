@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+#include <folly/fibers/Baton.h>
+
+typedef void* (FiberRunFunc)(void*);
+
+struct follib_fib_pool;
+
+/*
+ * Join handle of a fiber started with Fiber_Create(). It can be joined from
+ * anywhere: a fiber of any manager, or any thread. Fiber_Join() hands it back
+ * to the free list of the thread that created it.
+ */
+class Fib {
+public:
+   void Wait();
+   void Complete(void *res);
+   void *GetResult() { return result_; }
+   void Init(uint32_t mgrIdx) {
+      baton_.reset();
+      result_ = nullptr;
+      mgrIdx_ = mgrIdx;
+   }
+
+   follib_fib_pool     *pool{nullptr};       // where it goes back to
+   Fib                 *nextFree{nullptr};   // on the pool's remote list
+
+private:
+   folly::fibers::Baton baton_;
+   void                *result_{nullptr};
+   uint32_t             mgrIdx_{0};   // where the fiber runs
+};
+
+/*
+ * Counters of the calling thread's handle pool, i.e. of the handles created
+ * there.
+ */
+struct follib_fib_pool_stats {
+   uint64_t numAllocs;    // handles that came from the heap
+   uint64_t numReused;    // handles that came from the pool
+   uint32_t numPooled;    // handles in the pool right now
+};
+
+Fib *Fiber_Create(FiberRunFunc *func, void *param);
+Fib *Fiber_CreateOn(uint32_t mgrIdx, FiberRunFunc *func, void *param);
+int  Fiber_Join(Fib *fib, void **result);
+void Fiber_GetPoolStats(follib_fib_pool_stats *stats);
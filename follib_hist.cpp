@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "follib.h"
+#include "follib_hist.h"
+
+
+/*
+ * follib_hist_bucket_high --
+ *
+ *      Largest value that maps to bucket 'b'.
+ */
+static uint64_t
+follib_hist_bucket_high(uint32_t b)
+{
+   uint32_t shift;
+   uint64_t sub;
+
+   if (b < FOLLIB_HIST_SUB) {
+      return b;
+   }
+   shift = b / FOLLIB_HIST_SUB - 1;
+   sub = b % FOLLIB_HIST_SUB;
+   return ((FOLLIB_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+
+void
+follib_hist_reset(follib_hist *h)
+{
+   memset(h, 0, sizeof *h);
+}
+
+
+/*
+ * follib_hist_merge --
+ *
+ *      Add the samples of 'src' to 'dst'.
+ */
+void
+follib_hist_merge(follib_hist       *dst,
+                  const follib_hist *src)
+{
+   if (src->count == 0) {
+      return;
+   }
+   dst->min = dst->count == 0 ? src->min : std::min(dst->min, src->min);
+   dst->max = std::max(dst->max, src->max);
+   dst->count += src->count;
+   dst->sum += src->sum;
+   for (uint32_t i = 0; i < FOLLIB_HIST_NUM_BUCKETS; i++) {
+      dst->buckets[i] += src->buckets[i];
+   }
+}
+
+
+/*
+ * follib_hist_percentile --
+ *
+ *      Value at percentile 'pct' (0-100), as the upper bound of the bucket it
+ *      falls in, clamped to the recorded max.
+ */
+uint64_t
+follib_hist_percentile(const follib_hist *h,
+                       double             pct)
+{
+   uint64_t target;
+   uint64_t seen = 0;
+
+   if (h->count == 0) {
+      return 0;
+   }
+   target = std::max<uint64_t>(1, (uint64_t)(h->count * pct / 100.0 + 0.5));
+   for (uint32_t i = 0; i < FOLLIB_HIST_NUM_BUCKETS; i++) {
+      seen += h->buckets[i];
+      if (seen >= target) {
+         return std::min(follib_hist_bucket_high(i), h->max);
+      }
+   }
+   return h->max;
+}
+
+
+void
+follib_hist_print(const follib_hist *h,
+                  const char        *label)
+{
+   Log("%s: n=%lu min=%lu avg=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu\n",
+       label, h->count, h->min, h->count ? h->sum / h->count : 0,
+       follib_hist_percentile(h, 50), follib_hist_percentile(h, 90),
+       follib_hist_percentile(h, 99), follib_hist_percentile(h, 99.9), h->max);
+}
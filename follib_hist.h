@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Log-linear latency histogram, HDR style: values below 16 get a bucket each,
+ * then every power of two is split into 16 linear sub-buckets, which bounds
+ * the error to ~6%. Values of 2^36 and above (~68s in ns) all land in the
+ * last bucket. Not thread-safe: each histogram has a single writer and is
+ * merged elsewhere with follib_hist_merge().
+ */
+#define FOLLIB_HIST_SUB_BITS      4
+#define FOLLIB_HIST_SUB           (1u << FOLLIB_HIST_SUB_BITS)
+#define FOLLIB_HIST_MAX_MSB       35
+#define FOLLIB_HIST_NUM_BUCKETS   \
+   ((FOLLIB_HIST_MAX_MSB - FOLLIB_HIST_SUB_BITS + 2) * FOLLIB_HIST_SUB)
+
+struct follib_hist {
+   uint64_t count;
+   uint64_t sum;
+   uint64_t min;
+   uint64_t max;
+   uint64_t buckets[FOLLIB_HIST_NUM_BUCKETS];
+};
+
+void     follib_hist_reset(follib_hist *h);
+void     follib_hist_merge(follib_hist *dst, const follib_hist *src);
+uint64_t follib_hist_percentile(const follib_hist *h, double pct);
+void     follib_hist_print(const follib_hist *h, const char *label);
+
+
+static inline uint32_t
+follib_hist_bucket(uint64_t v)
+{
+   uint32_t msb;
+   uint32_t shift;
+
+   if (v < FOLLIB_HIST_SUB) {
+      return v;
+   }
+   msb = 63 - __builtin_clzll(v);
+   if (msb > FOLLIB_HIST_MAX_MSB) {
+      return FOLLIB_HIST_NUM_BUCKETS - 1;
+   }
+   shift = msb - FOLLIB_HIST_SUB_BITS;
+   return (shift + 1) * FOLLIB_HIST_SUB + ((v >> shift) & (FOLLIB_HIST_SUB - 1));
+}
+
+
+static inline void
+follib_hist_record(follib_hist *h,
+                   uint64_t     v)
+{
+   if (h->count == 0 || v < h->min) {
+      h->min = v;
+   }
+   if (v > h->max) {
+      h->max = v;
+   }
+   h->count++;
+   h->sum += v;
+   h->buckets[follib_hist_bucket(v)]++;
+}
@@ -1,14 +1,112 @@
+#include <time.h>
+
+#include <atomic>
 #include <cstdint> // uint32_t
 #include <thread>
+#include <vector>
 
 #pragma once
 
 #include <folly/fibers/Fiber.h>
 #include <folly/fibers/FiberManager.h>
-#include <folly/experimental/io/AsyncIO.h>
 #include <folly/io/async/EventBaseManager.h>
+#include <folly/io/async/HHWheelTimer.h>
+#include <folly/io/async/EventBaseObserver.h>
+
+#include "follib_hist.h"
+#include "follib_io.h"
+#include "follib_io_engine.h"
 
 struct AIOEventHandler;
+struct fiber_mgr;
+struct follib_buf_pool;
+struct follib_ws_queue;
+
+/*
+ * A fiber parked because the admission queue is full.
+ */
+struct follib_io_waiter {
+   folly::fibers::Baton  baton;
+   follib_io_waiter     *next{nullptr};
+};
+
+/*
+ * Drains the admission queue again, and has the engine retry what it
+ * couldn't hand to the kernel, when nothing is in flight: no completion is
+ * coming to do it then.
+ */
+struct follib_io_retry : public folly::HHWheelTimer::Callback {
+   void timeoutExpired() noexcept override;
+   void callbackCanceled() noexcept override { }
+
+   fiber_mgr *mgr{nullptr};
+   uint32_t   delayMs{0};     // current backoff, 0: not retrying
+};
+
+/*
+ * Per-manager admission queue: requests that didn't fit in the engine wait
+ * here until completions make room. Only touched by the owning manager.
+ */
+struct follib_io_queue {
+   follib_io_req          *head{nullptr};
+   follib_io_req          *tail{nullptr};
+   uint32_t                numQueued{0};
+   uint32_t                maxQueued{0};    // 0: unbounded
+   uint32_t                numReserved{0};  // slots held for woken waiters
+   follib_io_waiter       *waiters{nullptr};
+   follib_io_waiter       *waitersTail{nullptr};
+   follib_io_queue_stats   stats{};
+   follib_io_retry         retry;
+};
+
+/*
+ * File i/o latency histograms of a manager, or of one fd on a manager,
+ * indexed by [isRead][follib_io_lat_type]. Only touched by the owning
+ * manager. Per-fd ones only exist for the fds passed to follib_io_track_fd(),
+ * until follib_io_forget_fd().
+ */
+struct follib_io_lat {
+   follib_hist hist[2][FOLLIB_IO_LAT_NUM];
+};
+
+
+/*
+ * Runtime counters of a manager. Only ever written by the owning thread, so
+ * updates are plain relaxed load/store pairs rather than locked RMWs, and
+ * read from anywhere by follib_get_stats(). Padded on both sides so readers
+ * don't share a cache line with the rest of fiber_mgr.
+ */
+struct follib_mgr_counters {
+   char                  pad0[64];
+   std::atomic<uint64_t> loopIterations{0};
+   std::atomic<uint64_t> busyUsec{0};
+   std::atomic<uint64_t> idleUsec{0};
+   std::atomic<uint64_t> numFibers{0};
+   std::atomic<uint64_t> runQueueLen{0};
+   std::atomic<uint64_t> ioInFlight{0};
+   std::atomic<uint64_t> ioQueued{0};
+   std::atomic<uint64_t> numReads{0};
+   std::atomic<uint64_t> numWrites{0};
+   std::atomic<uint64_t> bytesRead{0};
+   std::atomic<uint64_t> bytesWritten{0};
+   std::atomic<uint64_t> remoteTasks{0};
+   char                  pad1[64];
+};
+
+static inline void
+follib_counter_add(std::atomic<uint64_t> *c,
+                   uint64_t               v)
+{
+   c->store(c->load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+static inline void
+follib_counter_set(std::atomic<uint64_t> *c,
+                   uint64_t               v)
+{
+   c->store(v, std::memory_order_relaxed);
+}
+
 
 /*
  * The state of per-thread fiber manager.
@@ -19,11 +117,46 @@ struct fiber_mgr {
    folly::fibers::Baton                         baton;
    std::unique_ptr<std::thread>                 th;
    uint32_t                                     idx{0};
+   int                                          cpu{-1};       // if pinned
+   int                                          numaNode{-1};  // if pinned
 
-   std::unique_ptr<folly::AsyncIO>   asyncIO;
+   std::unique_ptr<follib_io_engine> ioEngine;
    std::unique_ptr<AIOEventHandler>  aioEventHandler;
+   follib_io_queue                   ioQueue;
+   follib_buf_pool                  *bufPool{nullptr};
+   follib_ws_queue                  *wsQueue{nullptr};  // if work stealing
+
+   std::shared_ptr<folly::EventBaseObserver> loopObserver;
+   follib_mgr_counters                       counters;
+
+   bool                                                     ioLatEnabled{false};
+   follib_io_lat                                            ioLat{};
+   std::vector<std::unique_ptr<follib_io_lat>>              ioLatByFd;  // by fd
+
+   /*
+    * Last so that it goes first: pending timers may point to anything above
+    * but the event base.
+    */
+   folly::HHWheelTimer::UniquePtr                           timer;
 };
 
 
+static inline uint64_t
+follib_now_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
 fiber_mgr *follib_get_mgr();
+fiber_mgr *follib_get_mgr_unsafe();
+fiber_mgr *follib_get_mgr_by_idx(uint32_t idx);
+void follib_io_queue_drain(fiber_mgr *mgr);
+follib_buf_pool *follib_buf_pool_create(bool hugePages);
+void follib_buf_pool_destroy(follib_buf_pool *pool);
+follib_ws_queue *follib_ws_queue_create();
+void follib_ws_queue_destroy(follib_ws_queue *q);
 
@@ -1,9 +1,582 @@
-#include <folly/experimental/io/AsyncIO.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <folly/fibers/FiberManager.h>
+#include <folly/io/IOBuf.h>
 
 #include "follib_io.h"
 #include "follib_int.h"
 #include "follib.h"
 
+/*
+ * State of a batch of i/os issued by a single fiber. All the completions are
+ * delivered on the manager that submitted the batch so none of this needs to
+ * be atomic.
+ */
+struct follib_io_batch {
+   follib_io_op                     *ops{nullptr};
+   uint32_t                          numOps{0};
+   uint32_t                          numSubmitted{0};
+   uint32_t                          numDone{0};
+   uint32_t                          waitTarget{0};
+   folly::fibers::Baton              baton;
+   std::unique_ptr<follib_io_req[]>  reqs;
+   const follib_io_req              *wakeReq{nullptr};  // op that posted baton
+};
+
+
+/*
+ * follib_io_queue_push --
+ *
+ *      Append a request to the admission queue, parking the calling fiber
+ *      first if the queue is at its limit or others are already waiting:
+ *      throttled submitters get in first come, first served.
+ */
+static void
+follib_io_queue_push(follib_io_queue *q,
+                     follib_io_req   *req)
+{
+   if (q->maxQueued != 0 &&
+       (q->waiters || q->numQueued + q->numReserved >= q->maxQueued)) {
+      follib_io_waiter waiter;
+
+      if (q->waitersTail) {
+         q->waitersTail->next = &waiter;
+      } else {
+         q->waiters = &waiter;
+      }
+      q->waitersTail = &waiter;
+      q->stats.numThrottled++;
+      waiter.baton.wait();
+
+      // take the slot follib_io_queue_wake() held for us
+      DCHECK_GT(q->numReserved, 0u);
+      q->numReserved--;
+   }
+
+   req->next = nullptr;
+   req->prev = q->tail;
+   req->queued = true;
+   if (q->tail) {
+      q->tail->next = req;
+   } else {
+      q->head = req;
+   }
+   q->tail = req;
+   q->numQueued++;
+   q->stats.numQueued++;
+   q->stats.maxQueued = std::max(q->stats.maxQueued, q->numQueued);
+}
+
+
+/*
+ * follib_io_queue_wake --
+ *
+ *      Let throttled submitters in, in order, one per free slot. Each woken
+ *      waiter has its slot held until it runs, so it neither has to compete
+ *      for it nor goes back to the end of the line.
+ */
+static void
+follib_io_queue_wake(follib_io_queue *q)
+{
+   while (q->waiters && q->numQueued + q->numReserved < q->maxQueued) {
+      follib_io_waiter *waiter = q->waiters;
+
+      q->waiters = waiter->next;
+      if (!q->waiters) {
+         q->waitersTail = nullptr;
+      }
+      q->numReserved++;
+      waiter->baton.post();
+   }
+}
+
+
+/*
+ * follib_io_queue_remove --
+ *
+ *      Take a request out of the admission queue, in constant time so that
+ *      timing out a deep queue stays cheap. Returns false if it isn't there,
+ *      i.e. the engine has it.
+ */
+static bool
+follib_io_queue_remove(follib_io_queue *q,
+                       follib_io_req   *req)
+{
+   if (!req->queued) {
+      return false;
+   }
+
+   if (req->prev) {
+      req->prev->next = req->next;
+   } else {
+      q->head = req->next;
+   }
+   if (req->next) {
+      req->next->prev = req->prev;
+   } else {
+      q->tail = req->prev;
+   }
+   req->next = nullptr;
+   req->prev = nullptr;
+   req->queued = false;
+   q->numQueued--;
+
+   follib_io_queue_wake(q);
+   return true;
+}
+
+
+/*
+ * follib_io_engine_submit --
+ *
+ *      Hand requests to the engine, timestamping them first if latencies
+ *      are tracked. Returns how many the engine took.
+ */
+static inline uint32_t
+follib_io_engine_submit(fiber_mgr      *mgr,
+                        follib_io_req **reqs,
+                        uint32_t        numReqs)
+{
+   if (mgr->ioLatEnabled) {
+      const uint64_t now = follib_now_ns();
+
+      for (uint32_t i = 0; i < numReqs; i++) {
+         reqs[i]->submitNs = now;
+      }
+   }
+   return mgr->ioEngine->submit(reqs, numReqs);
+}
+
+
+static const uint32_t kIoRetryMaxMs = 64;
+
+
+/*
+ * follib_io_queue_kick --
+ *
+ *      Make sure queued requests, and those the engine took but couldn't
+ *      hand to the kernel, get another go when nothing is in flight, e.g.
+ *      io_submit() or io_uring_submit() said EAGAIN or the sq was full:
+ *      retry from the timer wheel, backing off up to kIoRetryMaxMs while the
+ *      engine keeps refusing them.
+ */
+static void
+follib_io_queue_kick(fiber_mgr *mgr)
+{
+   follib_io_retry *retry = &mgr->ioQueue.retry;
+   const uint32_t unsubmitted = mgr->ioEngine->unsubmitted();
+
+   if ((!mgr->ioQueue.head && unsubmitted == 0) ||
+       mgr->ioEngine->pending() > unsubmitted) {
+      retry->delayMs = 0;
+      return;
+   }
+   if (retry->isScheduled()) {
+      return;
+   }
+   retry->delayMs = retry->delayMs ? std::min(retry->delayMs * 2, kIoRetryMaxMs) : 1;
+   FLOGS(FOLLIB_LOG_IO, 2, "mgr %u: %s: %u queued, retrying in %ums\n",
+         mgr->idx, __func__, mgr->ioQueue.numQueued, retry->delayMs);
+   mgr->timer->scheduleTimeout(retry, std::chrono::milliseconds(retry->delayMs));
+}
+
+
+void
+follib_io_retry::timeoutExpired() noexcept
+{
+   mgr->ioEngine->flush();
+   follib_io_queue_drain(mgr);
+}
+
+
+/*
+ * follib_io_queue_drain --
+ *
+ *      Move as many queued requests as the engine has room for, then let
+ *      throttled submitters in. Called after completions have been reaped,
+ *      and from the retry timer.
+ */
+void
+follib_io_queue_drain(fiber_mgr *mgr)
+{
+   const uint32_t maxReqs = 64;
+   follib_io_queue *q = &mgr->ioQueue;
+   follib_io_req *reqs[maxReqs];
+
+   while (q->head) {
+      follib_io_req *req = q->head;
+      uint32_t numReqs = 0;
+      uint32_t n;
+
+      while (req && numReqs < maxReqs) {
+         reqs[numReqs++] = req;
+         req = req->next;
+      }
+      n = follib_io_engine_submit(mgr, reqs, numReqs);
+      for (uint32_t i = 0; i < n; i++) {
+         reqs[i]->queued = false;
+      }
+      if (n == 0) {
+         break;
+      }
+      q->head = n < numReqs ? reqs[n] : req;
+      if (q->head) {
+         q->head->prev = nullptr;
+      } else {
+         q->tail = nullptr;
+      }
+      q->numQueued -= n;
+   }
+
+   follib_io_queue_kick(mgr);
+   follib_io_queue_wake(q);
+}
+
+
+/*
+ * follib_io_submit --
+ *
+ *      Hand 'numReqs' requests to the manager's engine. Whatever doesn't fit
+ *      goes to the admission queue, behind the requests already there.
+ */
+static void
+follib_io_submit(fiber_mgr      *mgr,
+                 follib_io_req **reqs,
+                 uint32_t        numReqs)
+{
+   follib_io_queue *q = &mgr->ioQueue;
+   uint32_t n = 0;
+
+   if (!q->head) {
+      n = follib_io_engine_submit(mgr, reqs, numReqs);
+   }
+   for (uint32_t i = n; i < numReqs; i++) {
+      follib_io_queue_push(q, reqs[i]);
+   }
+
+   follib_io_queue_kick(mgr);
+}
+
+
+/*
+ * follib_io_get_queue_stats --
+ *
+ *      Return the admission queue counters of the calling manager.
+ */
+void
+follib_io_get_queue_stats(follib_io_queue_stats *stats)
+{
+   const fiber_mgr *mgr = follib_get_mgr();
+
+   *stats = mgr->ioQueue.stats;
+   stats->curQueued = mgr->ioQueue.numQueued;
+}
+
+
+static inline follib_io_lat *
+follib_io_lat_by_fd(const fiber_mgr *mgr,
+                    int              fd)
+{
+   if (fd < 0 || (size_t)fd >= mgr->ioLatByFd.size()) {
+      return nullptr;
+   }
+   return mgr->ioLatByFd[fd].get();
+}
+
+
+/*
+ * follib_io_lat_on_each_mgr --
+ *
+ *      Run 'func' on every manager in turn and wait for it: the histograms
+ *      are only ever touched from their own manager. The managers have to be
+ *      running. On a manager thread this has to be called from a fiber:
+ *      blocking the thread could deadlock with another manager doing the
+ *      same.
+ */
+template <typename F>
+static void
+follib_io_lat_on_each_mgr(F func)
+{
+   const fiber_mgr *self = follib_get_mgr_unsafe();
+   const uint32_t n = follib_get_num_managers();
+
+   DCHECK(self == nullptr || folly::fibers::onFiber());
+
+   for (uint32_t i = 0; i < n; i++) {
+      fiber_mgr *mgr = follib_get_mgr_by_idx(i);
+      folly::fibers::Baton done;
+
+      if (mgr == self) {
+         func(mgr);
+         continue;
+      }
+      mgr->manager->addTaskRemote([&]() {
+         follib_stats_remote_task();
+         func(mgr);
+         done.post();
+      });
+      done.wait();
+   }
+}
+
+
+/*
+ * follib_io_get_latency --
+ *
+ *      Merge the latency histograms of every manager for reads or writes,
+ *      restricted to 'fd' unless it is -1, into 'hist'. 'fd' has to be
+ *      tracked, see follib_io_track_fd(). Can be called from a fiber or from
+ *      a thread that isn't a manager, while the managers are running. 'hist'
+ *      is ~4KB, mind the fiber stack.
+ */
+void
+follib_io_get_latency(bool                isRead,
+                      follib_io_lat_type  type,
+                      int                 fd,
+                      follib_hist        *hist)
+{
+   follib_hist_reset(hist);
+
+   follib_io_lat_on_each_mgr([=](fiber_mgr *mgr) {
+      const follib_io_lat *lat = &mgr->ioLat;
+
+      if (fd != -1) {
+         lat = follib_io_lat_by_fd(mgr, fd);
+         if (lat == nullptr) {
+            return;
+         }
+      }
+      follib_hist_merge(hist, &lat->hist[isRead][type]);
+   });
+}
+
+
+/*
+ * follib_io_reset_latency --
+ *
+ *      Clear the latency histograms of every manager, tracked fds
+ *      included.
+ */
+void
+follib_io_reset_latency()
+{
+   follib_io_lat_on_each_mgr([](fiber_mgr *mgr) {
+      mgr->ioLat = follib_io_lat();
+      for (auto& fdLat : mgr->ioLatByFd) {
+         if (fdLat) {
+            *fdLat = follib_io_lat();
+         }
+      }
+   });
+}
+
+
+/*
+ * follib_io_track_fd --
+ *
+ *      Keep latency histograms for 'fd' on its own, on top of the
+ *      manager-wide ones. Their ~17KB per manager are allocated here, so
+ *      that completions never allocate. Same calling rules as
+ *      follib_io_get_latency().
+ */
+void
+follib_io_track_fd(int fd)
+{
+   DCHECK_GE(fd, 0);
+
+   follib_io_lat_on_each_mgr([=](fiber_mgr *mgr) {
+      if ((size_t)fd >= mgr->ioLatByFd.size()) {
+         mgr->ioLatByFd.resize(fd + 1);
+      }
+      if (!mgr->ioLatByFd[fd]) {
+         mgr->ioLatByFd[fd].reset(new follib_io_lat());
+      }
+   });
+}
+
+
+/*
+ * follib_io_forget_fd --
+ *
+ *      Stop tracking 'fd' and free its histograms. To be called before
+ *      closing a tracked fd, or its samples end up merged with those of
+ *      whatever reuses the number.
+ */
+void
+follib_io_forget_fd(int fd)
+{
+   follib_io_lat_on_each_mgr([=](fiber_mgr *mgr) {
+      if ((size_t)fd < mgr->ioLatByFd.size()) {
+         mgr->ioLatByFd[fd].reset();
+      }
+   });
+}
+
+
+/*
+ * follib_io_lat_record --
+ *
+ *      Add one sample to the manager-wide histograms, and to the fd's if it
+ *      is tracked.
+ */
+static void
+follib_io_lat_record(fiber_mgr           *mgr,
+                     const follib_io_req *req,
+                     follib_io_lat_type   type,
+                     uint64_t             ns)
+{
+   follib_io_lat *fdLat = follib_io_lat_by_fd(mgr, req->fd);
+
+   follib_hist_record(&mgr->ioLat.hist[req->isRead][type], ns);
+   if (fdLat != nullptr) {
+      follib_hist_record(&fdLat->hist[req->isRead][type], ns);
+   }
+}
+
+
+/*
+ * follib_io_lat_wakeup --
+ *
+ *      Called by the submitting fiber once it runs again after 'req'
+ *      completed.
+ */
+static inline void
+follib_io_lat_wakeup(fiber_mgr           *mgr,
+                     const follib_io_req *req)
+{
+   if (mgr->ioLatEnabled && req->completeNs != 0) {
+      follib_io_lat_record(mgr, req, FOLLIB_IO_LAT_WAKEUP,
+                           follib_now_ns() - req->completeNs);
+   }
+}
+
+
+/*
+ * follib_io_account --
+ *
+ *      Account for a completed request in the manager's counters and
+ *      histograms. Completions are reaped on the submitting manager.
+ */
+static inline void
+follib_io_account(follib_io_req *req)
+{
+   fiber_mgr *mgr = follib_get_mgr_unsafe();
+   auto c = &mgr->counters;
+
+   if (mgr->ioLatEnabled && req->submitNs != 0) {
+      req->completeNs = follib_now_ns();
+      follib_io_lat_record(mgr, req, FOLLIB_IO_LAT_DEVICE,
+                           req->completeNs - req->submitNs);
+   }
+
+   if (req->isRead) {
+      follib_counter_add(&c->numReads, 1);
+      if (req->result > 0) {
+         follib_counter_add(&c->bytesRead, req->result);
+      }
+   } else {
+      follib_counter_add(&c->numWrites, 1);
+      if (req->result > 0) {
+         follib_counter_add(&c->bytesWritten, req->result);
+      }
+   }
+}
+
+
+/*
+ * A single request a fiber is parked on, with an optional deadline. The
+ * timer fires on the submitting manager, same as the completion, so none of
+ * this needs to be atomic.
+ */
+struct follib_io_sync : public folly::HHWheelTimer::Callback {
+   void timeoutExpired() noexcept override {
+      timedOut = true;
+      if (submitted) {
+         Abort();
+      }
+   }
+   void callbackCanceled() noexcept override { }
+
+   /*
+    * Drop the request if it is still in the admission queue, or ask the
+    * engine to abort it. In the latter case the fiber keeps waiting for the
+    * completion: the kernel owns the buffers until then.
+    */
+   void Abort() {
+      if (done) {
+         return;
+      }
+      if (follib_io_queue_remove(&mgr->ioQueue, req)) {
+         req->result = -ETIMEDOUT;
+         done = true;
+         baton.post();
+         return;
+      }
+      mgr->ioEngine->cancel(req);
+      if (mgr->ioQueue.head) {
+         follib_io_queue_drain(mgr);
+      }
+   }
+
+   folly::fibers::Baton  baton;
+   fiber_mgr            *mgr{nullptr};
+   follib_io_req        *req{nullptr};
+   bool                  submitted{false};
+   bool                  done{false};
+   bool                  timedOut{false};
+};
+
+
+/*
+ * follib_io_do --
+ *
+ *      Submit a single request and park until it completes. If 'timeout'
+ *      isn't 0 and expires first, the request is aborted and its result is
+ *      -ETIMEDOUT, unless the device completed it anyway. Time spent throttled
+ *      on a full admission queue counts.
+ */
+static void
+follib_io_do(fiber_mgr                 *mgr,
+             follib_io_req             *req,
+             std::chrono::milliseconds  timeout = std::chrono::milliseconds(0))
+{
+   follib_io_sync sync;
+
+   sync.mgr  = mgr;
+   sync.req  = req;
+   req->arg  = &sync;
+   req->done = [](follib_io_req *r) {
+      auto s = static_cast<follib_io_sync *>(r->arg);
+
+      follib_io_account(r);
+      s->done = true;
+      s->baton.post();
+   };
+
+   if (timeout.count() > 0) {
+      mgr->timer->scheduleTimeout(&sync, timeout);
+   }
+
+   follib_io_submit(mgr, &req, 1);
+   sync.submitted = true;
+   if (sync.timedOut) {
+      sync.Abort();
+   }
+
+   sync.baton.wait();
+   sync.cancelTimeout();
+   if (sync.timedOut && req->result == -ECANCELED) {
+      req->result = -ETIMEDOUT;
+   }
+   follib_io_lat_wakeup(mgr, req);
+}
+
+
 /*
  * follib_prw --
  *
@@ -16,27 +589,395 @@ follib_prw(bool     isRead,
            uint32_t length,
            void    *buf)
 {
-   folly::fibers::Baton baton;
-   folly::AsyncIOOp op;
+   return follib_prw_timeout(isRead, fd, offset, length, buf,
+                             std::chrono::milliseconds(0));
+}
+
+
+/*
+ * follib_prw_timeout --
+ *
+ *      Same as follib_prw() but gives up after 'timeout', 0 meaning never.
+ *      A request that already reached the device may not be abortable, in
+ *      which case this still waits for it: the device owns 'buf' until then.
+ *      On failure, errno is ETIMEDOUT if the timeout is why.
+ */
+bool
+follib_prw_timeout(bool                      isRead,
+                   int                       fd,
+                   uint64_t                  offset,
+                   uint32_t                  length,
+                   void                     *buf,
+                   std::chrono::milliseconds timeout)
+{
+   follib_io_req req;
    fiber_mgr *mgr = follib_get_mgr();
 
-   FLOG(2, "mgr %u: %s: %s fd:%d off: %7lu len: %5u\n",
-        mgr->idx, __func__, isRead ? "read " : "write",
-        fd, offset, length);
+   FLOGDS(FOLLIB_LOG_IO, 2, "mgr %u: %s: %s fd:%d off: %7lu len: %5u\n",
+          mgr->idx, __func__, isRead ? "read " : "write",
+          fd, offset, length);
 
-   if (isRead) {
-      op.pread(fd, buf, length, offset);
-   } else {
-      op.pwrite(fd, buf, length, offset);
+   req.isRead = isRead;
+   req.fd     = fd;
+   req.offset = offset;
+   req.length = length;
+   req.buf    = buf;
+
+   follib_io_do(mgr, &req, timeout);
+
+   if (req.result < 0) {
+      errno = -req.result;
+   }
+   return req.result == length;
+}
+
+
+/*
+ * follib_io_iov_length --
+ *
+ *      Total length of an iovec, or -EINVAL if it can't make a single
+ *      request: no entries, more than IOV_MAX, or more than the 4GB a
+ *      request's length holds.
+ */
+static int64_t
+follib_io_iov_length(const struct iovec *iov,
+                     int                 iovcnt)
+{
+   uint64_t length = 0;
+
+   if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+      return -EINVAL;
+   }
+   for (int i = 0; i < iovcnt; i++) {
+      length += iov[i].iov_len;
+      if (length > UINT32_MAX) {
+         return -EINVAL;
+      }
+   }
+   return length;
+}
+
+
+/*
+ * follib_prwv --
+ *
+ *      Vectored flavor of follib_prw(): the whole iovec goes to the device as
+ *      a single request.
+ */
+bool
+follib_prwv(bool                isRead,
+            int                 fd,
+            uint64_t            offset,
+            const struct iovec *iov,
+            int                 iovcnt)
+{
+   return follib_prwv_timeout(isRead, fd, offset, iov, iovcnt,
+                              std::chrono::milliseconds(0));
+}
+
+
+/*
+ * follib_prwv_timeout --
+ *
+ *      Vectored flavor of follib_prw_timeout(). Fails with EINVAL, without
+ *      issuing anything, if the iovec can't make a single request.
+ */
+bool
+follib_prwv_timeout(bool                      isRead,
+                    int                       fd,
+                    uint64_t                  offset,
+                    const struct iovec       *iov,
+                    int                       iovcnt,
+                    std::chrono::milliseconds timeout)
+{
+   follib_io_req req;
+   fiber_mgr *mgr = follib_get_mgr();
+   int64_t length = follib_io_iov_length(iov, iovcnt);
+
+   if (length < 0) {
+      errno = -length;
+      return false;
+   }
+
+   FLOGDS(FOLLIB_LOG_IO, 2, "mgr %u: %s: %s fd:%d off: %7lu len: %5ld iovcnt: %d\n",
+          mgr->idx, __func__, isRead ? "read " : "write",
+          fd, offset, length, iovcnt);
+
+   req.isRead = isRead;
+   req.fd     = fd;
+   req.offset = offset;
+   req.length = length;
+   req.iov    = iov;
+   req.iovcnt = iovcnt;
+
+   follib_io_do(mgr, &req, timeout);
+
+   if (req.result < 0) {
+      errno = -req.result;
+   }
+
+   return req.result == length;
+}
+
+
+/*
+ * follib_iobuf_prwv --
+ *
+ *      Build an iovec out of an IOBuf chain and issue it. Reads go to the
+ *      tailroom of each buffer, writes come from their data. Short chains
+ *      don't allocate.
+ */
+static ssize_t
+follib_iobuf_prwv(bool                isRead,
+                  int                 fd,
+                  uint64_t            offset,
+                  const folly::IOBuf *chain)
+{
+   const size_t maxStackIov = 16;
+   struct iovec stackIov[maxStackIov];
+   std::vector<struct iovec> heapIov;
+   struct iovec *iov = stackIov;
+   const folly::IOBuf *b = chain;
+   follib_io_req req;
+   int64_t length;
+   size_t numBufs;
+   int iovcnt = 0;
+
+   numBufs = chain->countChainElements();
+   if (numBufs > maxStackIov) {
+      heapIov.resize(numBufs);
+      iov = heapIov.data();
+   }
+
+   do {
+      size_t len = isRead ? b->tailroom() : b->length();
+
+      if (len > 0) {
+         iov[iovcnt].iov_base = isRead ? (void *)b->tail() : (void *)b->data();
+         iov[iovcnt].iov_len  = len;
+         iovcnt++;
+      }
+      b = b->next();
+   } while (b != chain);
+
+   if (iovcnt == 0) {
+      return 0;
+   }
+   length = follib_io_iov_length(iov, iovcnt);
+   if (length < 0) {
+      errno = -length;
+      return length;
+   }
+
+   req.isRead = isRead;
+   req.length = length;
+   req.fd     = fd;
+   req.offset = offset;
+   req.iov    = iov;
+   req.iovcnt = iovcnt;
+
+   follib_io_do(follib_get_mgr(), &req);
+
+   return req.result;
+}
+
+
+/*
+ * follib_preadv --
+ *
+ *      Fill the tailroom of every buffer of 'chain' from 'fd' and append what
+ *      was read to the buffers. Returns true if all of the tailroom was
+ *      filled.
+ */
+bool
+follib_preadv(int           fd,
+              uint64_t      offset,
+              folly::IOBuf *chain)
+{
+   folly::IOBuf *b = chain;
+   uint64_t expected = 0;
+   size_t left;
+   ssize_t res;
+
+   do {
+      expected += b->tailroom();
+      b = b->next();
+   } while (b != chain);
+
+   res = follib_iobuf_prwv(true, fd, offset, chain);
+   if (res < 0) {
+      return false;
+   }
+
+   left = res;
+   do {
+      size_t n = std::min(left, b->tailroom());
+
+      b->append(n);
+      left -= n;
+      b = b->next();
+   } while (b != chain && left > 0);
+
+   return (uint64_t)res == expected;
+}
+
+
+/*
+ * follib_pwritev --
+ *
+ *      Write the data of all the buffers of 'chain' to 'fd'.
+ */
+bool
+follib_pwritev(int                 fd,
+               uint64_t            offset,
+               const folly::IOBuf *chain)
+{
+   ssize_t res = follib_iobuf_prwv(false, fd, offset, chain);
+
+   return res >= 0 && (uint64_t)res == chain->computeChainDataLength();
+}
+
+
+/*
+ * follib_prw_batch_wait_for --
+ *
+ *      Park the calling fiber until at least 'target' ops of the batch have
+ *      completed. There is a single wakeup no matter how many ops complete.
+ */
+static void
+follib_prw_batch_wait_for(follib_io_batch *batch,
+                          uint32_t         target)
+{
+   DCHECK_LE(target, batch->numSubmitted);
+
+   if (batch->numDone >= target) {
+      return;
+   }
+   batch->waitTarget = target;
+   batch->baton.wait();
+   batch->baton.reset();
+   batch->waitTarget = 0;
+   follib_io_lat_wakeup(follib_get_mgr(), batch->wakeReq);
+}
+
+
+/*
+ * follib_prw_batch_done --
+ *
+ *      Completion callback of one op of a batch.
+ */
+static void
+follib_prw_batch_done(follib_io_req *req)
+{
+   auto batch = static_cast<follib_io_batch *>(req->arg);
+
+   follib_io_account(req);
+   batch->ops[req - batch->reqs.get()].result = req->result;
+   batch->numDone++;
+   if (batch->numDone == batch->waitTarget) {
+      batch->wakeReq = req;
+      batch->baton.post();
    }
+}
+
+
+/*
+ * follib_prw_batch_submit --
+ *
+ *      Submit all the ops of 'ops' and return without waiting for them. The
+ *      ops array and the buffers it points to need to stay valid until
+ *      follib_prw_batch_free() returns.
+ *
+ *      The engine gets the whole batch at once: with libaio and io_uring
+ *      that's a single syscall as long as the engine has room for it.
+ */
+follib_io_batch *
+follib_prw_batch_submit(follib_io_op *ops,
+                        uint32_t      numOps)
+{
+   fiber_mgr *mgr = follib_get_mgr();
+   auto batch = new follib_io_batch;
+   std::unique_ptr<follib_io_req *[]> reqPtrs(new follib_io_req *[numOps]);
+
+   batch->ops = ops;
+   batch->numOps = numOps;
+   batch->reqs.reset(new follib_io_req[numOps]);
+
+   FLOGDS(FOLLIB_LOG_IO, 2, "mgr %u: %s: %u ops\n", mgr->idx, __func__, numOps);
+
+   for (uint32_t i = 0; i < numOps; i++) {
+      follib_io_op *op = &ops[i];
+      follib_io_req *req = &batch->reqs[i];
+
+      req->isRead = op->isRead;
+      req->fd     = op->fd;
+      req->offset = op->offset;
+      req->length = op->length;
+      req->buf    = op->buf;
+      req->arg    = batch;
+      req->done   = follib_prw_batch_done;
+      op->result  = -EINPROGRESS;
+      reqPtrs[i]  = req;
+   }
+
+   batch->numSubmitted = numOps;
+   follib_io_submit(mgr, reqPtrs.get(), numOps);
 
-   op.setNotificationCallback([&baton](folly::AsyncIOOp *ioOp) { baton.post(); });
+   return batch;
+}
 
-   mgr->asyncIO->submit(&op);
 
-   baton.wait();
+/*
+ * follib_prw_batch_wait --
+ *
+ *      Wait until 'quorum' ops of the batch have completed, or all of them if
+ *      'quorum' is 0. Returns the number of completed ops. The ops that are
+ *      still in flight keep a result of -EINPROGRESS.
+ */
+uint32_t
+follib_prw_batch_wait(follib_io_batch *batch,
+                      uint32_t         quorum)
+{
+   if (quorum == 0 || quorum > batch->numOps) {
+      quorum = batch->numOps;
+   }
+   follib_prw_batch_wait_for(batch, quorum);
 
-   return op.result() == length;
+   return batch->numDone;
 }
 
 
+/*
+ * follib_prw_batch_free --
+ *
+ *      Wait for the stragglers of the batch and release it.
+ */
+void
+follib_prw_batch_free(follib_io_batch *batch)
+{
+   follib_prw_batch_wait_for(batch, batch->numSubmitted);
+   delete batch;
+}
+
+
+/*
+ * follib_prw_batch --
+ *
+ *      Submit 'numOps' i/os and wait for all of them. Returns the number of
+ *      ops that transferred their full length.
+ */
+uint32_t
+follib_prw_batch(follib_io_op *ops,
+                 uint32_t      numOps)
+{
+   uint32_t numOK = 0;
+
+   follib_prw_batch_free(follib_prw_batch_submit(ops, numOps));
+
+   for (uint32_t i = 0; i < numOps; i++) {
+      if (ops[i].result == ops[i].length) {
+         numOK++;
+      }
+   }
+   return numOK;
+}
@@ -1,6 +1,53 @@
-
 #pragma once
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace folly {
+class IOBuf;
+}
+
+struct follib_hist;
+
+
+/*
+ * One element of a batch submitted via follib_prw_batch*(). 'result' is
+ * filled in on completion with the number of bytes transferred or a negative
+ * errno.
+ */
+struct follib_io_op {
+   bool      isRead;
+   int       fd;
+   uint64_t  offset;
+   uint32_t  length;
+   void     *buf;
+   ssize_t   result;
+};
+
+struct follib_io_batch;
+
+/*
+ * Back-pressure counters of the calling manager's admission queue.
+ */
+struct follib_io_queue_stats {
+   uint64_t numQueued;       // requests that had to wait for engine room
+   uint64_t numThrottled;    // submitters parked on a full queue
+   uint32_t curQueued;
+   uint32_t maxQueued;       // high-water mark of curQueued
+};
+
+/*
+ * The two halves of a file i/o's latency, see follib_io_get_latency().
+ */
+enum follib_io_lat_type {
+   FOLLIB_IO_LAT_DEVICE,     // handed to the engine -> completion reaped
+   FOLLIB_IO_LAT_WAKEUP,     // completion reaped -> submitting fiber resumed
+   FOLLIB_IO_LAT_NUM,
+};
+
 
 bool
 follib_prw(bool     isRead,
@@ -9,6 +56,72 @@ follib_prw(bool     isRead,
            uint32_t length,
            void    *buf);
 
+bool
+follib_prwv(bool                isRead,
+            int                 fd,
+            uint64_t            offset,
+            const struct iovec *iov,
+            int                 iovcnt);
+
+bool
+follib_prw_timeout(bool                      isRead,
+                   int                       fd,
+                   uint64_t                  offset,
+                   uint32_t                  length,
+                   void                     *buf,
+                   std::chrono::milliseconds timeout);
+
+bool
+follib_prwv_timeout(bool                      isRead,
+                    int                       fd,
+                    uint64_t                  offset,
+                    const struct iovec       *iov,
+                    int                       iovcnt,
+                    std::chrono::milliseconds timeout);
+
+bool
+follib_preadv(int           fd,
+              uint64_t      offset,
+              folly::IOBuf *chain);
+
+bool
+follib_pwritev(int                 fd,
+               uint64_t            offset,
+               const folly::IOBuf *chain);
+
+follib_io_batch *
+follib_prw_batch_submit(follib_io_op *ops,
+                        uint32_t      numOps);
+
+uint32_t
+follib_prw_batch_wait(follib_io_batch *batch,
+                      uint32_t         quorum);
+
+void
+follib_prw_batch_free(follib_io_batch *batch);
+
+uint32_t
+follib_prw_batch(follib_io_op *ops,
+                 uint32_t      numOps);
+
+void
+follib_io_get_queue_stats(follib_io_queue_stats *stats);
+
+void
+follib_io_get_latency(bool                isRead,
+                      follib_io_lat_type  type,
+                      int                 fd,
+                      follib_hist        *hist);
+
+void
+follib_io_reset_latency();
+
+void
+follib_io_track_fd(int fd);
+
+void
+follib_io_forget_fd(int fd);
+
 static inline bool
 follib_pwrite(int      fd,
               uint64_t offset,
@@ -29,3 +142,43 @@ follib_pread(int      fd,
 }
 
 
+static inline bool
+follib_pwritev(int                 fd,
+               uint64_t            offset,
+               const struct iovec *iov,
+               int                 iovcnt)
+{
+   return follib_prwv(false, fd, offset, iov, iovcnt);
+}
+
+
+static inline bool
+follib_preadv(int                 fd,
+              uint64_t            offset,
+              const struct iovec *iov,
+              int                 iovcnt)
+{
+   return follib_prwv(true, fd, offset, iov, iovcnt);
+}
+
+
+static inline bool
+follib_pwrite_timeout(int                       fd,
+                      uint64_t                  offset,
+                      uint32_t                  length,
+                      void                     *buf,
+                      std::chrono::milliseconds timeout)
+{
+   return follib_prw_timeout(false, fd, offset, length, buf, timeout);
+}
+
+
+static inline bool
+follib_pread_timeout(int                       fd,
+                     uint64_t                  offset,
+                     uint32_t                  length,
+                     void                     *buf,
+                     std::chrono::milliseconds timeout)
+{
+   return follib_prw_timeout(true, fd, offset, length, buf, timeout);
+}
@@ -0,0 +1,408 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#ifdef FOLLIB_HAVE_URING
+#include <liburing.h>
+#endif
+
+#include <glog/logging.h>
+
+#include "follib.h"
+#include "follib_io_engine.h"
+
+
+/*
+ * follib_io_eventfd_drain --
+ *
+ *      Reset the counter of a completion eventfd.
+ */
+static void
+follib_io_eventfd_drain(int fd)
+{
+   eventfd_t val;
+
+   while (eventfd_read(fd, &val) == 0) {
+   }
+}
+
+
+/*
+ * Linux native aio engine. Unlike folly::AsyncIO it hands all the iocbs of a
+ * submission to a single io_submit() call.
+ */
+class follib_aio_engine : public follib_io_engine {
+public:
+   ~follib_aio_engine() override {
+      if (ctx_) {
+         io_destroy(ctx_);
+      }
+      if (evfd_ >= 0) {
+         ::close(evfd_);
+      }
+   }
+
+   int Init(uint32_t depth) {
+      int err;
+
+      err = io_setup(depth, &ctx_);
+      if (err < 0) {
+         ctx_ = 0;
+         return -err;
+      }
+      evfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (evfd_ < 0) {
+         return errno;
+      }
+      capacity_ = depth;
+      return 0;
+   }
+
+   const char *name() const override { return "libaio"; }
+   int         pollFd() const override { return evfd_; }
+   uint32_t    capacity() const override { return capacity_; }
+   uint32_t    pending() const override { return pending_; }
+
+   uint32_t submit(follib_io_req **reqs, uint32_t numReqs) override {
+      struct iocb *cbs[kMaxBatch];
+      uint32_t n;
+      int res;
+
+      n = std::min({ numReqs, capacity_ - pending_, kMaxBatch });
+
+      for (uint32_t i = 0; i < n; i++) {
+         follib_io_req *req = reqs[i];
+         struct iocb *cb = &req->iocb;
+
+         if (req->iov) {
+            if (req->isRead) {
+               io_prep_preadv(cb, req->fd, req->iov, req->iovcnt, req->offset);
+            } else {
+               io_prep_pwritev(cb, req->fd, req->iov, req->iovcnt, req->offset);
+            }
+         } else if (req->isRead) {
+            io_prep_pread(cb, req->fd, req->buf, req->length, req->offset);
+         } else {
+            io_prep_pwrite(cb, req->fd, req->buf, req->length, req->offset);
+         }
+         io_set_eventfd(cb, evfd_);
+         cb->data = req;
+         cbs[i] = cb;
+      }
+      if (n == 0) {
+         return 0;
+      }
+
+      res = io_submit(ctx_, n, cbs);
+      if (res == -EAGAIN) {
+         return 0;
+      }
+      if (res < 0) {
+         /*
+          * The first iocb was rejected: fail it so that the caller makes
+          * progress.
+          */
+         reqs[0]->result = res;
+         reqs[0]->done(reqs[0]);
+         return 1;
+      }
+      pending_ += res;
+      return res;
+   }
+
+   uint32_t pollCompleted() override {
+      struct io_event events[kMaxBatch];
+      struct timespec ts = { 0, 0 };
+      uint32_t numDone = 0;
+      int res;
+
+      follib_io_eventfd_drain(evfd_);
+
+      do {
+         res = io_getevents(ctx_, 0, kMaxBatch, events, &ts);
+         if (res < 0) {
+            DCHECK_EQ(res, -EINTR);
+            break;
+         }
+         for (int i = 0; i < res; i++) {
+            follib_io_req *req = static_cast<follib_io_req *>(events[i].data);
+
+            DCHECK_GT(pending_, 0);
+            pending_--;
+            req->result = static_cast<long>(events[i].res);
+            req->done(req);
+         }
+         numDone += res;
+      } while (res == (int)kMaxBatch);
+
+      return numDone;
+   }
+
+   void cancel(follib_io_req *req) override {
+      struct io_event event;
+      int res;
+
+      /*
+       * Only a few drivers implement cancel, file systems and block devices
+       * don't. Older kernels hand the completion back here, newer ones post
+       * it to the ring as usual and return -EINPROGRESS.
+       */
+      res = io_cancel(ctx_, &req->iocb, &event);
+      if (res == 0) {
+         DCHECK_GT(pending_, 0);
+         pending_--;
+         req->result = static_cast<long>(event.res);
+         req->done(req);
+      } else {
+         FLOGS(FOLLIB_LOG_IO, 2, "%s: fd %d: %s\n", __func__, req->fd,
+               strerror(-res));
+      }
+   }
+
+private:
+   static constexpr uint32_t kMaxBatch = 64;
+
+   io_context_t ctx_{0};
+   int          evfd_{-1};
+   uint32_t     capacity_{0};
+   uint32_t     pending_{0};
+};
+
+constexpr uint32_t follib_aio_engine::kMaxBatch;
+
+
+#ifdef FOLLIB_HAVE_URING
+
+/*
+ * io_uring engine. All the sqes of a submission are published with a single
+ * io_uring_submit(), which is a no-op syscall-wise when SQPOLL is on and the
+ * kernel thread is awake. Buffered i/o is fine here, unlike with libaio.
+ */
+class follib_uring_engine : public follib_io_engine {
+public:
+   ~follib_uring_engine() override {
+      if (ringInited_) {
+         io_uring_queue_exit(&ring_);
+      }
+      if (evfd_ >= 0) {
+         ::close(evfd_);
+      }
+   }
+
+   int Init(uint32_t depth,
+            bool     sqPoll,
+            uint32_t sqIdleMs) {
+      struct io_uring_params params;
+      int err;
+
+      sqPoll_ = sqPoll;
+      memset(&params, 0, sizeof params);
+      if (sqPoll) {
+         params.flags |= IORING_SETUP_SQPOLL;
+         params.sq_thread_idle = sqIdleMs;
+      }
+      err = io_uring_queue_init_params(depth, &ring_, &params);
+      if (err < 0) {
+         return -err;
+      }
+      ringInited_ = true;
+
+      evfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (evfd_ < 0) {
+         return errno;
+      }
+      err = io_uring_register_eventfd(&ring_, evfd_);
+      if (err < 0) {
+         return -err;
+      }
+      /*
+       * Never have more requests in flight than sq entries so that the cq,
+       * which is at least twice as large, can't overflow.
+       */
+      capacity_ = params.sq_entries;
+      return 0;
+   }
+
+   const char *name() const override { return "io_uring"; }
+   int         pollFd() const override { return evfd_; }
+   uint32_t    capacity() const override { return capacity_; }
+   uint32_t    pending() const override { return pending_; }
+
+   uint32_t unsubmitted() const override {
+      return io_uring_sq_ready(&ring_);
+   }
+
+   /*
+    * Publish the prepared sqes. EAGAIN and EBUSY leave them in the sq for
+    * the next try, from pollCompleted() or from the caller's retry timer
+    * when nothing else is in flight. Any other error fails them.
+    */
+   void flush() override {
+      int res;
+
+      if (io_uring_sq_ready(&ring_) == 0) {
+         return;
+      }
+      res = io_uring_submit(&ring_);
+      if (res >= 0 || res == -EAGAIN || res == -EBUSY) {
+         return;
+      }
+      LOG(ERROR) << "io_uring_submit: " << strerror(-res);
+      if (!sqPoll_) {
+         FailUnsubmitted(res);
+      }
+   }
+
+   uint32_t submit(follib_io_req **reqs, uint32_t numReqs) override {
+      uint32_t n = 0;
+
+      while (n < numReqs && pending_ < capacity_) {
+         follib_io_req *req = reqs[n];
+         struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+
+         if (!sqe) {
+            break;
+         }
+         if (req->iov) {
+            if (req->isRead) {
+               io_uring_prep_readv(sqe, req->fd, req->iov, req->iovcnt, req->offset);
+            } else {
+               io_uring_prep_writev(sqe, req->fd, req->iov, req->iovcnt, req->offset);
+            }
+         } else if (req->isRead) {
+            io_uring_prep_read(sqe, req->fd, req->buf, req->length, req->offset);
+         } else {
+            io_uring_prep_write(sqe, req->fd, req->buf, req->length, req->offset);
+         }
+         io_uring_sqe_set_data(sqe, req);
+         pending_++;
+         n++;
+      }
+      flush();
+      return n;
+   }
+
+   uint32_t pollCompleted() override {
+      struct io_uring_cqe *cqe;
+      uint32_t numDone = 0;
+      uint32_t numCqes = 0;
+      unsigned head;
+
+      follib_io_eventfd_drain(evfd_);
+
+      io_uring_for_each_cqe(&ring_, head, cqe) {
+         follib_io_req *req = static_cast<follib_io_req *>(io_uring_cqe_get_data(cqe));
+
+         numCqes++;
+         if (!req) {
+            continue;   // cancel request, see cancel()
+         }
+         DCHECK_GT(pending_, 0);
+         pending_--;
+         req->result = cqe->res;
+         req->done(req);
+         numDone++;
+      }
+      io_uring_cq_advance(&ring_, numCqes);
+
+      /*
+       * A previous io_uring_submit() may have been short.
+       */
+      flush();
+
+      return numDone;
+   }
+
+   void cancel(follib_io_req *req) override {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+
+      /*
+       * The cancel request posts a cqe of its own, without data. There's
+       * at most one per request in flight, so the cq, twice the size of the
+       * sq, still can't overflow.
+       */
+      if (!sqe) {
+         return;
+      }
+      io_uring_prep_cancel(sqe, req, 0);
+      io_uring_sqe_set_data(sqe, nullptr);
+      flush();
+   }
+
+private:
+   /*
+    * The kernel took none of the sqes between its head and our tail: turn
+    * them into nops, whose cqes pollCompleted() skips like those of cancel
+    * requests, and fail their requests. Without SQPOLL the kernel only reads
+    * the sq from io_uring_enter(), so rewriting them is safe. sq entries map
+    * to sqes one to one, see __io_uring_flush_sq().
+    */
+   void FailUnsubmitted(int res) {
+      const unsigned mask = *ring_.sq.kring_mask;
+      const unsigned tail = *ring_.sq.ktail;
+      unsigned head = io_uring_smp_load_acquire(ring_.sq.khead);
+
+      for (; head != tail; head++) {
+         struct io_uring_sqe *sqe = &ring_.sq.sqes[head & mask];
+         auto req = reinterpret_cast<follib_io_req *>(sqe->user_data);
+
+         io_uring_prep_nop(sqe);
+         io_uring_sqe_set_data(sqe, nullptr);
+         if (req) {
+            DCHECK_GT(pending_, 0);
+            pending_--;
+            req->result = res;
+            req->done(req);
+         }
+      }
+   }
+
+   struct io_uring ring_;
+   bool            ringInited_{false};
+   bool            sqPoll_{false};
+   int             evfd_{-1};
+   uint32_t        capacity_{0};
+   uint32_t        pending_{0};
+};
+
+#endif // FOLLIB_HAVE_URING
+
+
+/*
+ * follib_io_engine_create --
+ *
+ *      Instantiate the backend requested in 'opts', falling back to libaio if
+ *      io_uring isn't compiled in or the kernel doesn't support it.
+ */
+std::unique_ptr<follib_io_engine>
+follib_io_engine_create(const follib_options& opts)
+{
+   int err;
+
+#ifdef FOLLIB_HAVE_URING
+   if (opts.ioBackend != FOLLIB_IO_BACKEND_LIBAIO) {
+      auto engine = std::make_unique<follib_uring_engine>();
+
+      err = engine->Init(opts.ioDepth, opts.ioUringSqPoll, opts.ioUringSqIdleMs);
+      if (err == 0) {
+         return std::move(engine);
+      }
+      FLOGS(FOLLIB_LOG_IO, 0, "%s: io_uring unavailable: %s, using libaio.\n",
+            __func__, strerror(err));
+   }
+#else
+   if (opts.ioBackend == FOLLIB_IO_BACKEND_URING) {
+      FLOGS(FOLLIB_LOG_IO, 0, "%s: io_uring not compiled in, using libaio.\n", __func__);
+   }
+#endif
+
+   auto engine = std::make_unique<follib_aio_engine>();
+
+   err = engine->Init(opts.ioDepth);
+   CHECK_EQ(err, 0) << "io_setup: " << strerror(err);
+
+   return std::move(engine);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <libaio.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+
+struct follib_options;
+
+/*
+ * An i/o request as handed to an engine. The submitter owns it and has to
+ * keep it alive until 'done' has been called. 'done' runs on the manager that
+ * submitted the request, from the eventfd handler.
+ */
+struct follib_io_req {
+   bool            isRead{true};
+   int             fd{-1};
+   uint64_t        offset{0};
+   uint32_t        length{0};      // total length, summed over iov if set
+   void           *buf{nullptr};
+   const iovec    *iov{nullptr};   // vectored i/o instead of 'buf' if set
+   int             iovcnt{0};
+   ssize_t         result{0};
+
+   void          (*done)(follib_io_req *req){nullptr};
+   void           *arg{nullptr};
+   follib_io_req  *next{nullptr};    // admission queue linkage
+   follib_io_req  *prev{nullptr};
+   bool            queued{false};    // in the admission queue
+   uint64_t        submitNs{0};      // handed to the engine, if timed
+   uint64_t        completeNs{0};    // completion reaped, if timed
+
+   struct iocb     iocb;      // libaio engine only
+};
+
+
+/*
+ * follib_io_engine --
+ *
+ *      Per-manager file i/o backend. Completions are signalled through
+ *      pollFd(), an eventfd the manager watches on its event base.
+ */
+class follib_io_engine {
+public:
+   virtual ~follib_io_engine() {}
+
+   virtual const char *name() const = 0;
+   virtual int         pollFd() const = 0;
+   virtual uint32_t    capacity() const = 0;
+   virtual uint32_t    pending() const = 0;
+
+   /*
+    * Requests submit() took, counted in pending(), that the kernel hasn't
+    * accepted yet because it said EAGAIN or EBUSY. No completion is coming
+    * for them until flush() gets them in.
+    */
+   virtual uint32_t    unsubmitted() const { return 0; }
+   virtual void        flush() { }
+
+   /*
+    * Submit up to 'numReqs' requests with as few syscalls as the backend
+    * allows. Returns how many were consumed; the caller retries the rest
+    * once some completions have been reaped.
+    */
+   virtual uint32_t    submit(follib_io_req **reqs, uint32_t numReqs) = 0;
+
+   /*
+    * Reap completed requests and call their 'done' callback. Returns the
+    * number of completions processed.
+    */
+   virtual uint32_t    pollCompleted() = 0;
+
+   /*
+    * Try to abort a request handed to submit() that hasn't completed. Its
+    * 'done' callback still runs exactly once, possibly from here, with
+    * -ECANCELED if the abort worked or the usual result if the device got
+    * there first or the backend can't abort it.
+    */
+   virtual void        cancel(follib_io_req *req) = 0;
+};
+
+
+std::unique_ptr<follib_io_engine>
+follib_io_engine_create(const follib_options& opts);
@@ -1,42 +1,616 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <glog/logging.h>
 
+#include "follib.h"
 #include "follib_log.h"
 
+/*
+ * Asynchronous logging
+ *
+ * Every thread that logs owns a single-producer/single-consumer byte ring:
+ * records are appended without locks nor syscalls, and a background thread
+ * drains all the rings to stdout. When a ring is full the record is dropped
+ * and counted. Ordering is only preserved within a thread.
+ *
+ * The drain thread sleeps until a commit finds it idle, so an idle process
+ * doesn't wake it at all, and stdout is written with only outLock held.
+ *
+ * Until follib_log_init() and after follib_log_exit() everything is printed
+ * synchronously.
+ */
+
+uint32_t logLevels[FOLLIB_LOG_NUM_SUBSYS] = { 2, 2, 2, 2 };
+
+static const uint32_t kRingSize      = 256 * 1024;
+static const uint32_t kMaxRecordSize = 1024;
+static const uint32_t kShortTextLen  = 256;
+static const uint32_t kOutBufSize    = 64 * 1024;
+
+enum follib_log_rec_type : uint16_t {
+   FOLLIB_LOG_REC_PAD,        // filler up to the end of the ring
+   FOLLIB_LOG_REC_TEXT,       // preformatted text
+   FOLLIB_LOG_REC_DEFERRED,   // format + arguments
+};
+
+struct follib_log_rec {
+   uint32_t size;     // including this header, multiple of 8
+   uint16_t type;
+   uint16_t len;      // text length of a TEXT record
+};
+
+struct follib_log_deferred_rec {
+   follib_log_rec    hdr;
+   follib_log_fmt_fn fn;
+   const char       *fmt;
+   // arguments follow
+};
+
+/*
+ * 'head' and 'pendingHead' belong to the producer, 'tail' to the drain
+ * thread. They are on separate cache lines.
+ */
+struct follib_log_ring {
+   std::atomic<uint64_t> head{0};
+   uint64_t              pendingHead{0};
+   std::atomic<uint64_t> numDropped{0};
+   char                  pad0[64 - 3 * sizeof(uint64_t)];
+
+   std::atomic<uint64_t> tail{0};
+   uint64_t              numDroppedReported{0};
+   std::atomic<bool>     orphaned{false};
+   char                  pad1[64 - 2 * sizeof(uint64_t) - sizeof(std::atomic<bool>)];
+
+   alignas(8) uint8_t    data[kRingSize];
+};
+
+static struct {
+   std::atomic<bool>              active{false};
+   std::atomic<uint64_t>          gen{0};
+   std::mutex                     outLock;    // out, taken before 'lock'
+   std::mutex                     lock;       // rings
+   std::vector<follib_log_ring *> rings;
+   std::string                    out;
+   std::mutex                     wakeLock;   // stop, cv
+   std::condition_variable        cv;
+   std::atomic<bool>              drainIdle{false};
+   std::thread                    drainThread;
+   bool                           stop{false};
+} logState;
+
+static void follib_log_kick();
+
+/*
+ * The calling thread's ring. Flagged as orphaned when the thread goes away
+ * so the drain thread can free it once empty.
+ */
+struct follib_log_tls {
+   follib_log_ring *ring{nullptr};
+   uint64_t         gen{0};
+
+   ~follib_log_tls() {
+      if (ring && gen == logState.gen.load()) {
+         ring->orphaned.store(true, std::memory_order_release);
+         follib_log_kick();
+      }
+   }
+};
+
+static thread_local follib_log_tls logTls;
+
+
+static inline uint32_t
+follib_log_roundup(uint32_t size)
+{
+   return (size + 7) & ~7u;
+}
+
+
+static follib_log_ring *
+follib_log_get_ring()
+{
+   uint64_t gen = logState.gen.load(std::memory_order_acquire);
+
+   if (logTls.ring && logTls.gen == gen) {
+      return logTls.ring;
+   }
+
+   auto ring = new follib_log_ring;
+   {
+      std::lock_guard<std::mutex> guard(logState.lock);
+      logState.rings.push_back(ring);
+   }
+   logTls.ring = ring;
+   logTls.gen = gen;
+   return ring;
+}
+
+
+/*
+ * follib_log_reserve --
+ *
+ *      Reserve 'size' contiguous bytes in the calling thread's ring. The
+ *      record becomes visible to the drain thread on follib_log_commit().
+ */
+static follib_log_rec *
+follib_log_reserve(follib_log_ring *ring,
+                   uint32_t         size)
+{
+   uint64_t head = ring->head.load(std::memory_order_relaxed);
+   uint64_t tail = ring->tail.load(std::memory_order_acquire);
+   uint32_t off = head & (kRingSize - 1);
+   uint32_t pad = 0;
+
+   if (off + size > kRingSize) {
+      pad = kRingSize - off;
+   }
+   if (head + pad + size - tail > kRingSize) {
+      ring->numDropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+   }
+   if (pad) {
+      auto padRec = reinterpret_cast<follib_log_rec *>(&ring->data[off]);
+
+      padRec->size = pad;
+      padRec->type = FOLLIB_LOG_REC_PAD;
+      head += pad;
+      off = 0;
+   }
+
+   auto rec = reinterpret_cast<follib_log_rec *>(&ring->data[off]);
+   rec->size = size;
+   ring->pendingHead = head + size;
+   return rec;
+}
+
+
+/*
+ * follib_log_wake --
+ *
+ *      Wake the drain thread unless someone else already did.
+ */
+static void
+follib_log_wake()
+{
+   if (logState.drainIdle.exchange(false, std::memory_order_acq_rel)) {
+      std::lock_guard<std::mutex> guard(logState.wakeLock);
+      logState.cv.notify_one();
+   }
+}
+
+
+/*
+ * follib_log_kick --
+ *
+ *      Wake the drain thread if it is idle. Pairs with the fence in
+ *      follib_log_drain_thread_func(): either it sees what was committed
+ *      before this, or this sees it idle.
+ */
+static inline void
+follib_log_kick()
+{
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (logState.drainIdle.load(std::memory_order_relaxed)) {
+      follib_log_wake();
+   }
+}
+
+
+void
+follib_log_commit()
+{
+   follib_log_ring *ring = logTls.ring;
+
+   ring->head.store(ring->pendingHead, std::memory_order_release);
+   follib_log_kick();
+}
+
+
+void *
+follib_log_reserve_deferred(size_t            argsSize,
+                            follib_log_fmt_fn fn,
+                            const char       *fmt,
+                            bool             *isSync)
+{
+   const uint32_t size = follib_log_roundup(sizeof(follib_log_deferred_rec) + argsSize);
+   follib_log_deferred_rec *rec;
+
+   *isSync = !logState.active.load(std::memory_order_relaxed);
+   if (*isSync) {
+      return nullptr;
+   }
+
+   rec = reinterpret_cast<follib_log_deferred_rec *>(
+            follib_log_reserve(follib_log_get_ring(), size));
+   if (!rec) {
+      return nullptr;
+   }
+   rec->hdr.type = FOLLIB_LOG_REC_DEFERRED;
+   rec->fn = fn;
+   rec->fmt = fmt;
+   return rec + 1;
+}
+
+
+/*
+ * follib_log_vwrite --
+ *
+ *      Format on the stack and reserve just what that took. Messages too long
+ *      for the stack buffer are formatted again, straight into the ring.
+ */
+static void
+follib_log_vwrite(const char *fmt,
+                  va_list     ap)
+{
+   char buf[kShortTextLen];
+   follib_log_ring *ring;
+   follib_log_rec *rec;
+   uint32_t reserved;
+   va_list ap2;
+   int len;
+
+   if (!logState.active.load(std::memory_order_relaxed)) {
+      vprintf(fmt, ap);
+      return;
+   }
+
+   va_copy(ap2, ap);
+   len = vsnprintf(buf, sizeof buf, fmt, ap);
+   if (len < 0) {
+      va_end(ap2);
+      return;
+   }
+   len = std::min<int>(len, kMaxRecordSize - sizeof *rec - 1);
+
+   /*
+    * vsnprintf() needs room for the terminating NUL, the copy doesn't.
+    */
+   ring = follib_log_get_ring();
+   reserved = follib_log_roundup(sizeof *rec + len + (len < (int)sizeof buf ? 0 : 1));
+   rec = follib_log_reserve(ring, reserved);
+   if (rec) {
+      if (len < (int)sizeof buf) {
+         memcpy(rec + 1, buf, len);
+      } else {
+         vsnprintf(reinterpret_cast<char *>(rec + 1), len + 1, fmt, ap2);
+      }
+      rec->type = FOLLIB_LOG_REC_TEXT;
+      rec->len = len;
+      rec->size = follib_log_roundup(sizeof *rec + len);
+      ring->pendingHead -= reserved - rec->size;
+      follib_log_commit();
+   }
+   va_end(ap2);
+}
+
+
+/*
+ * follib_log_write_text --
+ *
+ *      Queue an unformatted message, split over several records if needed.
+ */
+static void
+follib_log_write_text(const char *msg,
+                      size_t      msgLen)
+{
+   follib_log_ring *ring = follib_log_get_ring();
+
+   while (msgLen > 0) {
+      uint32_t len = std::min<size_t>(msgLen, kMaxRecordSize - sizeof(follib_log_rec));
+      follib_log_rec *rec = follib_log_reserve(ring, follib_log_roundup(sizeof *rec + len));
+
+      if (!rec) {
+         return;
+      }
+      rec->type = FOLLIB_LOG_REC_TEXT;
+      rec->len = len;
+      memcpy(rec + 1, msg, len);
+      follib_log_commit();
+
+      msg += len;
+      msgLen -= len;
+   }
+}
+
+
+/*
+ * Log --
+ *
+ *      Log routine.
+ */
+void
+Log(const char *fmt,
+    ...)
+{
+   va_list ap;
+
+   va_start(ap, fmt);
+   follib_log_vwrite(fmt, ap);
+   va_end(ap);
+}
+
+
+/*
+ * follib_log_out_flush --
+ *
+ *      Write out what the rings were drained to. Called with logState.outLock
+ *      held but not logState.lock.
+ */
+static void
+follib_log_out_flush()
+{
+   if (!logState.out.empty()) {
+      fwrite(logState.out.data(), 1, logState.out.size(), stdout);
+      fflush(stdout);
+      logState.out.clear();
+   }
+}
+
+
+/*
+ * follib_log_ring_drain --
+ *
+ *      Format everything committed to 'ring' into logState.out. Called with
+ *      logState.outLock and logState.lock held.
+ */
+static bool
+follib_log_ring_drain(follib_log_ring *ring)
+{
+   uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+   uint64_t head = ring->head.load(std::memory_order_acquire);
+   uint64_t numDropped = ring->numDropped.load(std::memory_order_relaxed);
+   bool didWork = tail != head;
+
+   while (tail != head) {
+      auto rec = reinterpret_cast<follib_log_rec *>(&ring->data[tail & (kRingSize - 1)]);
+
+      switch (rec->type) {
+      case FOLLIB_LOG_REC_TEXT:
+         logState.out.append(reinterpret_cast<char *>(rec + 1), rec->len);
+         break;
+      case FOLLIB_LOG_REC_DEFERRED: {
+         auto drec = reinterpret_cast<follib_log_deferred_rec *>(rec);
+         size_t outLen = logState.out.size();
+         int len;
+
+         logState.out.resize(outLen + kMaxRecordSize);
+         len = drec->fn(&logState.out[outLen], kMaxRecordSize, drec->fmt, drec + 1);
+         logState.out.resize(outLen + (len > 0 ? std::min<int>(len, kMaxRecordSize - 1) : 0));
+         break;
+      }
+      default:
+         break;
+      }
+      tail += rec->size;
+   }
+   ring->tail.store(tail, std::memory_order_release);
+
+   if (numDropped != ring->numDroppedReported) {
+      char buf[128];
+      int len = snprintf(buf, sizeof buf, "follib_log: dropped %lu messages\n",
+                         numDropped - ring->numDroppedReported);
+
+      logState.out.append(buf, std::min<size_t>(len, sizeof buf - 1));
+      ring->numDroppedReported = numDropped;
+   }
+   return didWork;
+}
+
+
+/*
+ * follib_log_drain_all --
+ *
+ *      Drain all the rings and free the ones of exited threads. Called with
+ *      logState.outLock and logState.lock held.
+ */
+static bool
+follib_log_drain_all()
+{
+   bool didWork = false;
+
+   for (size_t i = 0; i < logState.rings.size(); ) {
+      follib_log_ring *ring = logState.rings[i];
+      bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+      didWork |= follib_log_ring_drain(ring);
+      if (orphaned) {
+         logState.rings[i] = logState.rings.back();
+         logState.rings.pop_back();
+         delete ring;
+      } else {
+         i++;
+      }
+   }
+   return didWork;
+}
+
+
+/*
+ * follib_log_drain --
+ *
+ *      Drain all the rings, then write the result out once logState.lock is
+ *      released: a thread logging for the first time never waits on stdout.
+ *      outLock serializes the drains, which keeps each thread's messages in
+ *      order.
+ */
+static bool
+follib_log_drain()
+{
+   std::lock_guard<std::mutex> outGuard(logState.outLock);
+   bool didWork;
+
+   {
+      std::lock_guard<std::mutex> guard(logState.lock);
+      didWork = follib_log_drain_all();
+   }
+   follib_log_out_flush();
+   return didWork;
+}
+
+
+/*
+ * follib_log_drain_thread_func --
+ *
+ *      Drain until there's nothing left, then sleep until a commit or
+ *      follib_log_exit() finds 'drainIdle' raised and lowers it.
+ */
+static void
+follib_log_drain_thread_func()
+{
+   while (true) {
+      if (follib_log_drain()) {
+         continue;
+      }
+
+      logState.drainIdle.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (follib_log_drain()) {
+         logState.drainIdle.store(false, std::memory_order_relaxed);
+         continue;
+      }
+
+      std::unique_lock<std::mutex> guard(logState.wakeLock);
+      logState.cv.wait(guard, [] {
+         return logState.stop || !logState.drainIdle.load(std::memory_order_relaxed);
+      });
+      if (logState.stop) {
+         break;
+      }
+   }
+}
+
+
+/*
+ * follib_log_set_level --
+ *
+ *      Set the runtime level of one subsystem, or of all of them with
+ *      FOLLIB_LOG_ALL. Messages above FOLLIB_LOG_MAX_LEVEL stay compiled out
+ *      whatever the level.
+ */
+void
+follib_log_set_level(follib_log_subsys ss,
+                     uint32_t          lvl)
+{
+   if (ss == FOLLIB_LOG_ALL) {
+      for (uint32_t i = 0; i < FOLLIB_LOG_NUM_SUBSYS; i++) {
+         logLevels[i] = lvl;
+      }
+   } else {
+      logLevels[ss] = lvl;
+   }
+}
+
+
+/*
+ * follib_log_flush --
+ *
+ *      Synchronously output whatever is queued.
+ */
+void
+follib_log_flush()
+{
+   follib_log_drain();
+}
+
+
+/*
+ * glog messages go through the same rings. FATAL ones are about to abort
+ * the process and are written synchronously, after whatever is queued.
+ */
 class FollibLogger : public google::base::Logger {
+public:
+   explicit FollibLogger(bool sync) : sync_(sync) {}
+
    void Write(bool force,
               time_t timestamp,
               const char *msg,
               int msgLen) {
-      printf("%.*s", msgLen, msg);
+      if (sync_ || !logState.active.load(std::memory_order_relaxed)) {
+         follib_log_flush();
+         fwrite(msg, 1, msgLen, stdout);
+         fflush(stdout);
+      } else {
+         follib_log_write_text(msg, msgLen);
+      }
    }
-   void Flush() { }
+   void Flush() { follib_log_flush(); }
    uint32_t LogSize() { return 0; }
+
+private:
+   bool sync_;
 };
 
 static FollibLogger *logger;
+static FollibLogger *fatalLogger;
 
 void
 follib_log_init(const char *argv0)
 {
    DCHECK(!logger);
 
+   logState.stop = false;
+   logState.drainIdle = false;
+   logState.out.reserve(kOutBufSize);
+   logState.gen++;
+   logState.drainThread = std::thread(follib_log_drain_thread_func);
+   logState.active = true;
+
    google::InitGoogleLogging(argv0);
    google::InstallFailureSignalHandler();
 
-   logger = new FollibLogger();
+   logger = new FollibLogger(false);
+   fatalLogger = new FollibLogger(true);
 
    google::base::SetLogger(google::INFO, logger);
    google::base::SetLogger(google::WARNING, logger);
    google::base::SetLogger(google::ERROR, logger);
-   google::base::SetLogger(google::FATAL, logger);
+   google::base::SetLogger(google::FATAL, fatalLogger);
    LOG(INFO) << __func__;
 }
 
+/*
+ * follib_log_exit --
+ *
+ *      Stop the drain thread and free the rings. Other threads must not be
+ *      logging anymore.
+ */
 void
 follib_log_exit()
 {
    LOG(INFO) << __func__;
    google::ShutdownGoogleLogging();
    delete logger;
+   delete fatalLogger;
    logger = nullptr;
+   fatalLogger = nullptr;
+
+   logState.active = false;
+   {
+      std::lock_guard<std::mutex> guard(logState.wakeLock);
+      logState.stop = true;
+   }
+   logState.cv.notify_one();
+   logState.drainThread.join();
+
+   std::lock_guard<std::mutex> outGuard(logState.outLock);
+   {
+      std::lock_guard<std::mutex> guard(logState.lock);
+
+      for (auto ring : logState.rings) {
+         follib_log_ring_drain(ring);
+         delete ring;
+      }
+      logState.rings.clear();
+   }
+   follib_log_out_flush();
+   logState.gen++;
 }
@@ -1,4 +1,140 @@
 #pragma once
 
+#include <stdio.h>
+
+#include <cstdint>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Messages above FOLLIB_LOG_MAX_LEVEL are compiled out, arguments included
+ * (make LOG_MAX_LEVEL=n). Below it each subsystem is filtered at runtime
+ * against its own level.
+ */
+#ifndef FOLLIB_LOG_MAX_LEVEL
+#define FOLLIB_LOG_MAX_LEVEL 3
+#endif
+
+enum follib_log_subsys {
+   FOLLIB_LOG_GEN,
+   FOLLIB_LOG_IO,
+   FOLLIB_LOG_NET,
+   FOLLIB_LOG_SCHED,
+   FOLLIB_LOG_NUM_SUBSYS,
+   FOLLIB_LOG_ALL = FOLLIB_LOG_NUM_SUBSYS,
+};
+
+extern uint32_t logLevels[FOLLIB_LOG_NUM_SUBSYS];
+
 void follib_log_init(const char *argv0);
 void follib_log_exit();
+void follib_log_flush();
+void follib_log_set_level(follib_log_subsys ss, uint32_t lvl);
+
+void Log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Forces the level to be a constant expression, so that the runtime check
+ * and everything under it go away even at -O0 once it is above the cap.
+ */
+template <uint32_t Lvl>
+struct follib_log_compiled
+   : std::integral_constant<bool, Lvl <= FOLLIB_LOG_MAX_LEVEL> {};
+
+#define FLOG_ENABLED(_ss, _lvl)                  \
+   (follib_log_compiled<(_lvl)>::value &&        \
+    (_lvl) <= logLevels[(_ss)])
+
+#define FLOGS(_ss, _lvl, _fmt, ...)              \
+   do {                                          \
+      if (FLOG_ENABLED(_ss, _lvl)) {             \
+         Log(_fmt, __VA_ARGS__);                 \
+      }                                          \
+   } while (0)
+
+/*
+ * Same as FLOGS() but formatting is left to the log drain thread. For hot
+ * paths; see LogDeferred() for the restrictions on the arguments.
+ */
+#define FLOGDS(_ss, _lvl, _fmt, ...)             \
+   do {                                          \
+      if (FLOG_ENABLED(_ss, _lvl)) {             \
+         LogDeferred(_fmt, __VA_ARGS__);         \
+      }                                          \
+   } while (0)
+
+#define FLOG(_lvl, _fmt, ...)  FLOGS(FOLLIB_LOG_GEN, _lvl, _fmt, __VA_ARGS__)
+#define FLOGD(_lvl, _fmt, ...) FLOGDS(FOLLIB_LOG_GEN, _lvl, _fmt, __VA_ARGS__)
+
+/*
+ * Deferred logging: the arguments are copied to the calling thread's ring as
+ * is and only formatted by the drain thread. They have to be scalars, and
+ * strings have to be string literals or otherwise never freed (__func__,
+ * ...).
+ */
+typedef int (*follib_log_fmt_fn)(char *buf, size_t len, const char *fmt,
+                                 const void *args);
+
+void *follib_log_reserve_deferred(size_t            argsSize,
+                                  follib_log_fmt_fn fn,
+                                  const char       *fmt,
+                                  bool             *isSync);
+void  follib_log_commit();
+
+template <typename Tuple, size_t... I>
+inline int
+follib_log_format_tuple(char                     *buf,
+                        size_t                    len,
+                        const char               *fmt,
+                        const Tuple              *args,
+                        std::index_sequence<I...>)
+{
+   return snprintf(buf, len, fmt, std::get<I>(*args)...);
+}
+
+template <typename... Args>
+int
+follib_log_format_deferred(char       *buf,
+                           size_t      len,
+                           const char *fmt,
+                           const void *args)
+{
+   return follib_log_format_tuple(buf, len, fmt,
+                                  static_cast<const std::tuple<Args...> *>(args),
+                                  std::index_sequence_for<Args...>());
+}
+
+template <typename... Args>
+struct follib_log_all_scalar;
+
+template <>
+struct follib_log_all_scalar<> : std::true_type {};
+
+template <typename T, typename... Rest>
+struct follib_log_all_scalar<T, Rest...>
+   : std::integral_constant<bool, std::is_scalar<T>::value &&
+                                  follib_log_all_scalar<Rest...>::value> {};
+
+template <typename... Args>
+inline void
+LogDeferred(const char *fmt,
+            Args...     args)
+{
+   typedef std::tuple<Args...> ArgsTuple;
+   static_assert(follib_log_all_scalar<Args...>::value,
+                 "deferred log arguments must be scalars");
+   static_assert(alignof(ArgsTuple) <= 8, "over-aligned log argument");
+
+   bool isSync;
+   void *p = follib_log_reserve_deferred(sizeof(ArgsTuple),
+                                         follib_log_format_deferred<Args...>,
+                                         fmt, &isSync);
+   if (p) {
+      new (p) ArgsTuple(args...);
+      follib_log_commit();
+   } else if (isSync) {
+      printf(fmt, args...);
+   }
+}
@@ -0,0 +1,801 @@
+#include <errno.h>
+#include <string.h>
+
+#include <folly/io/Cursor.h>
+
+#include "follib.h"
+#include "follib_net.h"
+#include "follib_timer.h"
+
+static const size_t kMinReadSize   = 4096;
+static const size_t kReadAllocSize = 64 * 1024;
+
+
+void
+FiberSocketReader::Attach(folly::AsyncSocket *sock)
+{
+   sock_ = sock;
+   sock_->setReadCB(this);
+}
+
+
+/*
+ * FiberSocketReader::Close --
+ *
+ *      Fail the pending and future reads, once the buffered data has been
+ *      consumed.
+ */
+void
+FiberSocketReader::Close()
+{
+   closed_ = true;
+   Wake();
+}
+
+
+void
+FiberSocketReader::Wake()
+{
+   if (need_ != 0) {
+      need_ = 0;
+      baton_.post();
+   }
+}
+
+
+void
+FiberSocketReader::timeoutExpired() noexcept
+{
+   FLOGS(FOLLIB_LOG_NET, 1, "-- %s: buffered %zu need %zu\n",
+         __func__, Buffered(), need_);
+   timedOut_ = true;
+   Wake();
+}
+
+
+/*
+ * Arms the reader's timeout for the duration of a Read*() call. Calls made
+ * by another one, like ReadFrame() calling ReadExact(), share its deadline
+ * and its outcome, whether or not the timer has fired yet.
+ */
+class FiberSocketReader::Deadline {
+public:
+   explicit Deadline(FiberSocketReader *reader) : reader_(reader) {
+      if (reader_->deadlineDepth_++ > 0) {
+         return;
+      }
+      reader_->timedOut_ = false;
+      if (reader_->timeout_.count() > 0) {
+         follib_get_timer()->scheduleTimeout(reader_, reader_->timeout_);
+      }
+   }
+   ~Deadline() {
+      if (--reader_->deadlineDepth_ == 0 && reader_->isScheduled()) {
+         reader_->cancelTimeout();
+      }
+   }
+
+private:
+   FiberSocketReader *reader_;
+};
+
+
+void
+FiberSocketReader::getReadBuffer(void  **bufPtr,
+                                 size_t *lenPtr)
+{
+   auto p = queue_.preallocate(kMinReadSize, kReadAllocSize);
+
+   *bufPtr = p.first;
+   *lenPtr = p.second;
+}
+
+
+void
+FiberSocketReader::readDataAvailable(size_t readLen) noexcept
+{
+   queue_.postallocate(readLen);
+
+   FLOGS(FOLLIB_LOG_NET, 1, "-- %s:%u read %zu buffered %zu\n",
+         __func__, __LINE__, readLen, Buffered());
+
+   if (need_ != 0 && Buffered() >= need_) {
+      Wake();
+   }
+   if (need_ == 0 && Buffered() >= maxBuffered_) {
+      sock_->setReadCB(nullptr);
+      paused_ = true;
+   }
+}
+
+
+void
+FiberSocketReader::readEOF() noexcept
+{
+   eof_ = true;
+   Wake();
+}
+
+
+void
+FiberSocketReader::readErr(const folly::AsyncSocketException& ex) noexcept
+{
+   FLOGS(FOLLIB_LOG_NET, 3, "-- %s: %s\n", __func__, ex.what());
+   eof_ = true;
+   failed_ = true;
+   Wake();
+}
+
+
+/*
+ * FiberSocketReader::WaitFor --
+ *
+ *      Park until at least 'len' bytes are buffered. Returns false if the
+ *      socket hit EOF, was closed or the call timed out first.
+ */
+bool
+FiberSocketReader::WaitFor(size_t len)
+{
+   while (Buffered() < len) {
+      if (eof_ || closed_ || timedOut_) {
+         return false;
+      }
+      if (paused_) {
+         paused_ = false;
+         sock_->setReadCB(this);
+      }
+      need_ = len;
+      baton_.wait();
+      baton_.reset();
+   }
+   return true;
+}
+
+
+/*
+ * FiberSocketReader::Consumed --
+ *
+ *      Bookkeeping after 'len' bytes were taken off the front of the queue.
+ */
+void
+FiberSocketReader::Consumed(size_t len)
+{
+   lineScanned_ = lineScanned_ > len ? lineScanned_ - len : 0;
+
+   if (paused_ && Buffered() < maxBuffered_ && !eof_ && !closed_) {
+      paused_ = false;
+      sock_->setReadCB(this);
+   }
+}
+
+
+/*
+ * FiberSocketReader::FindEOL --
+ *
+ *      Look for a '\n' in what's buffered, skipping the part already scanned
+ *      by a previous call.
+ */
+bool
+FiberSocketReader::FindEOL(size_t *eol)
+{
+   const folly::IOBuf *head = queue_.front();
+   const folly::IOBuf *b = head;
+   size_t off = 0;
+
+   if (!head) {
+      return false;
+   }
+   do {
+      const size_t len = b->length();
+
+      if (off + len > lineScanned_) {
+         const size_t start = lineScanned_ > off ? lineScanned_ - off : 0;
+         auto p = static_cast<const uint8_t *>(memchr(b->data() + start, '\n',
+                                                      len - start));
+         if (p) {
+            *eol = off + (p - b->data());
+            return true;
+         }
+      }
+      off += len;
+      b = b->next();
+   } while (b != head);
+
+   lineScanned_ = off;
+   return false;
+}
+
+
+/*
+ * FiberSocketReader::ReadExact --
+ *
+ *      Copy exactly 'len' bytes to 'buf'. Returns 'len', or -1 on EOF,
+ *      close or timeout.
+ */
+ssize_t
+FiberSocketReader::ReadExact(void   *buf,
+                             size_t  len)
+{
+   Deadline deadline(this);
+
+   if (!WaitFor(len)) {
+      return -1;
+   }
+   if (len > 0) {
+      folly::io::Cursor(queue_.front()).pull(buf, len);
+      queue_.trimStart(len);
+      Consumed(len);
+   }
+   return len;
+}
+
+
+/*
+ * FiberSocketReader::ReadExact --
+ *
+ *      Same as above but hands out the buffered IOBufs themselves. Returns
+ *      NULL on EOF, close or timeout.
+ */
+std::unique_ptr<folly::IOBuf>
+FiberSocketReader::ReadExact(size_t len)
+{
+   std::unique_ptr<folly::IOBuf> buf;
+   Deadline deadline(this);
+
+   if (!WaitFor(len)) {
+      return nullptr;
+   }
+   if (len == 0) {
+      return folly::IOBuf::create(0);
+   }
+   buf = queue_.split(len);
+   Consumed(len);
+   return buf;
+}
+
+
+/*
+ * FiberSocketReader::ReadLine --
+ *
+ *      Return the next line without its "\n" or "\r\n". Fails on EOF, close,
+ *      timeout, or if no EOL shows up within 'maxLen' bytes.
+ */
+bool
+FiberSocketReader::ReadLine(std::string *line,
+                            size_t       maxLen)
+{
+   size_t eol;
+   Deadline deadline(this);
+
+   while (!FindEOL(&eol)) {
+      if (Buffered() > maxLen || !WaitFor(Buffered() + 1)) {
+         return false;
+      }
+   }
+   if (eol > maxLen) {
+      return false;
+   }
+
+   line->resize(eol);
+   if (eol > 0) {
+      folly::io::Cursor(queue_.front()).pull(&(*line)[0], eol);
+   }
+   queue_.trimStart(eol + 1);
+   Consumed(eol + 1);
+
+   if (!line->empty() && line->back() == '\r') {
+      line->pop_back();
+   }
+   return true;
+}
+
+
+/*
+ * FiberSocketReader::ReadFrame --
+ *
+ *      Read one frame made of a 32-bit big-endian length and that many bytes
+ *      of payload, and return the payload. Returns NULL on EOF, close,
+ *      timeout or if the frame is larger than 'maxLen' (which is left in the
+ *      buffer).
+ */
+std::unique_ptr<folly::IOBuf>
+FiberSocketReader::ReadFrame(size_t maxLen)
+{
+   uint32_t len;
+   Deadline deadline(this);
+
+   if (!WaitFor(kFrameHdrSize)) {
+      return nullptr;
+   }
+   len = folly::io::Cursor(queue_.front()).readBE<uint32_t>();
+   if (len > maxLen) {
+      FLOGS(FOLLIB_LOG_NET, 0, "%s: frame of %u bytes over limit %zu\n",
+            __func__, len, maxLen);
+      return nullptr;
+   }
+   if (!WaitFor(kFrameHdrSize + len)) {
+      return nullptr;
+   }
+   queue_.trimStart(kFrameHdrSize);
+   Consumed(kFrameHdrSize);
+
+   return ReadExact(len);
+}
+
+
+/*
+ * An uncorked write parked on the socket; it is its own write callback.
+ */
+struct FiberSocketWriter::Waiter : public folly::AsyncWriter::WriteCallback {
+   void writeSuccess() noexcept override {
+      ok = true;
+      baton.post();
+   }
+   void writeErr(size_t bytesWritten,
+                 const folly::AsyncSocketException& ex) noexcept override {
+      FLOGS(FOLLIB_LOG_NET, 1, "-- %s: %s (%zu bytes written)\n",
+            __func__, ex.what(), bytesWritten);
+      ok = false;
+      baton.post();
+   }
+
+   folly::fibers::Baton  baton;
+   bool                  ok{false};
+};
+
+
+/*
+ * A zero-copy write also waits for the socket to let go of the buffers,
+ * which it does once the kernel reports it no longer uses their pages.
+ */
+struct FiberSocketWriter::ZeroCopyWaiter : public FiberSocketWriter::Waiter {
+   static void Release(void *buf, void *userData) {
+      auto waiter = static_cast<ZeroCopyWaiter *>(userData);
+
+      if (--waiter->numHeld == 0) {
+         waiter->released.post();
+      }
+   }
+
+   folly::fibers::Baton  released;
+   uint32_t              numHeld{0};
+};
+
+
+/*
+ * A fiber parked in Flush().
+ */
+struct FiberSocketWriter::FlushWaiter {
+   folly::fibers::Baton  baton;
+   FlushWaiter          *next{nullptr};
+};
+
+
+void
+FiberSocketWriter::Attach(folly::AsyncSocket *sock)
+{
+   sock_ = sock;
+   failed_ = false;
+}
+
+
+/*
+ * FiberSocketWriter::Detach --
+ *
+ *      Let go of the socket before it is closed or destroyed: drop what is
+ *      still corked, fail the fibers parked in Flush() and any later write.
+ *      The chains already handed to the socket are failed by its close, which
+ *      calls back into the writer, so the writer has to be around until then.
+ */
+void
+FiberSocketWriter::Detach()
+{
+   FlushWaiter *w = flushWaiters_;
+
+   if (isLoopCallbackScheduled()) {
+      cancelLoopCallback();
+   }
+   pending_.move();
+   failed_ = true;
+   sock_ = nullptr;
+
+   flushWaiters_ = nullptr;
+   while (w) {
+      FlushWaiter *next = w->next;
+
+      w->baton.post();
+      w = next;
+   }
+}
+
+
+/*
+ * FiberSocketWriter::SetCork --
+ *
+ *      Turn write coalescing on or off. Turning it off flushes what's
+ *      pending.
+ */
+void
+FiberSocketWriter::SetCork(bool cork)
+{
+   if (cork_ && !cork) {
+      Flush();
+   }
+   cork_ = cork;
+}
+
+
+/*
+ * FiberSocketWriter::SetZeroCopy --
+ *
+ *      Send writes of at least 'threshold' bytes with MSG_ZEROCOPY, or stop
+ *      doing so if 0. Only pays off for large writes: pinning the pages and
+ *      reaping the completion cost more than copying a few KB. Returns false
+ *      if the socket doesn't support it.
+ */
+bool
+FiberSocketWriter::SetZeroCopy(size_t threshold)
+{
+   if (!sock_) {
+      return false;
+   }
+   if (!sock_->setZeroCopy(threshold > 0)) {
+      FLOGS(FOLLIB_LOG_NET, 0, "%s: zero-copy not supported on fd %d\n",
+            __func__, sock_->getFd());
+      zcThreshold_ = 0;
+      return threshold == 0;
+   }
+   zcThreshold_ = threshold;
+   return true;
+}
+
+
+/*
+ * FiberSocketWriter::Send --
+ *
+ *      Hand everything corked so far to the socket as a single chain.
+ */
+void
+FiberSocketWriter::Send()
+{
+   if (isLoopCallbackScheduled()) {
+      cancelLoopCallback();
+   }
+   if (pending_.empty()) {
+      return;
+   }
+
+   FLOGS(FOLLIB_LOG_NET, 2, "-- %s: %zu bytes\n", __func__, pending_.chainLength());
+
+   numInFlight_++;
+   sock_->writeChain(this, pending_.move());
+}
+
+
+void
+FiberSocketWriter::runLoopCallback() noexcept
+{
+   Send();
+}
+
+
+void
+FiberSocketWriter::BatchDone()
+{
+   DCHECK_GT(numInFlight_, 0u);
+
+   if (--numInFlight_ == 0) {
+      FlushWaiter *w = flushWaiters_;
+
+      flushWaiters_ = nullptr;
+      while (w) {
+         FlushWaiter *next = w->next;
+
+         w->baton.post();
+         w = next;
+      }
+   }
+}
+
+
+void
+FiberSocketWriter::writeSuccess() noexcept
+{
+   BatchDone();
+}
+
+
+void
+FiberSocketWriter::writeErr(size_t                            bytesWritten,
+                            const folly::AsyncSocketException& ex) noexcept
+{
+   FLOGS(FOLLIB_LOG_NET, 1, "-- %s: %s (%zu bytes written)\n",
+         __func__, ex.what(), bytesWritten);
+   failed_ = true;
+   BatchDone();
+}
+
+
+/*
+ * FiberSocketWriter::Flush --
+ *
+ *      Send what is corked and park until everything written so far is on
+ *      the wire. Returns false if any of it failed.
+ */
+bool
+FiberSocketWriter::Flush()
+{
+   if (!sock_) {
+      return false;
+   }
+   Send();
+   if (numInFlight_ > 0) {
+      FlushWaiter waiter;
+
+      waiter.next = flushWaiters_;
+      flushWaiters_ = &waiter;
+      waiter.baton.wait();
+   }
+   return !failed_;
+}
+
+
+/*
+ * FiberSocketWriter::Writev --
+ *
+ *      Uncorked: write the whole iovec and park until it's on the wire.
+ *
+ *      Corked: copy the iovec to the pending chain, which goes out at the end
+ *      of the loop iteration, and return right away; only park if too much
+ *      is pending. A failure is reported by the next write or Flush().
+ *
+ *      Returns false if the socket failed or was detached.
+ */
+bool
+FiberSocketWriter::Writev(const struct iovec *iov,
+                          int                 iovcnt)
+{
+   if (!sock_) {
+      return false;
+   }
+   if (zcThreshold_ > 0) {
+      size_t len = 0;
+
+      for (int i = 0; i < iovcnt; i++) {
+         len += iov[i].iov_len;
+      }
+      if (len >= zcThreshold_) {
+         return WriteZeroCopy(iov, iovcnt);
+      }
+   }
+
+   if (!cork_) {
+      Waiter waiter;
+
+      sock_->writev(&waiter, iov, iovcnt);
+      waiter.baton.wait();
+      return waiter.ok;
+   }
+
+   if (failed_) {
+      return false;
+   }
+   for (int i = 0; i < iovcnt; i++) {
+      pending_.append(iov[i].iov_base, iov[i].iov_len);
+   }
+   return Corked();
+}
+
+
+/*
+ * FiberSocketWriter::Corked --
+ *
+ *      Something was added to the pending chain: make sure it goes out.
+ */
+bool
+FiberSocketWriter::Corked()
+{
+   if (pending_.chainLength() >= kMaxCorked) {
+      return Flush();
+   }
+   if (!isLoopCallbackScheduled()) {
+      sock_->getEventBase()->runInLoop(this);
+   }
+   return true;
+}
+
+
+/*
+ * FiberSocketWriter::WriteZeroCopy --
+ *
+ *      Send the iovec with MSG_ZEROCOPY, after what is corked, and park until
+ *      it's on the wire and the socket has released the buffers.
+ */
+bool
+FiberSocketWriter::WriteZeroCopy(const struct iovec *iov,
+                                 int                 iovcnt)
+{
+   ZeroCopyWaiter waiter;
+   std::unique_ptr<folly::IOBuf> chain;
+
+   if (cork_) {
+      if (failed_) {
+         return false;
+      }
+      Send();
+   }
+
+   for (int i = 0; i < iovcnt; i++) {
+      if (iov[i].iov_len == 0) {
+         continue;
+      }
+      waiter.numHeld++;
+      auto buf = folly::IOBuf::takeOwnership(iov[i].iov_base, iov[i].iov_len,
+                                             iov[i].iov_len,
+                                             ZeroCopyWaiter::Release, &waiter);
+      if (chain) {
+         chain->prependChain(std::move(buf));
+      } else {
+         chain = std::move(buf);
+      }
+   }
+   if (!chain) {
+      return true;
+   }
+
+   FLOGS(FOLLIB_LOG_NET, 2, "-- %s: %zu bytes\n", __func__,
+         (size_t)chain->computeChainDataLength());
+
+   sock_->writeChain(&waiter, std::move(chain),
+                     folly::WriteFlags::WRITE_MSG_ZEROCOPY);
+   waiter.baton.wait();
+   waiter.released.wait();
+   return waiter.ok;
+}
+
+
+bool
+FiberSocketWriter::Write(const void *buf,
+                         size_t      len)
+{
+   struct iovec iov;
+
+   iov.iov_base = const_cast<void *>(buf);
+   iov.iov_len  = len;
+   return Writev(&iov, 1);
+}
+
+
+static void
+FiberSocketWriter_FreeBuf(void *buf,
+                          void *userData)
+{
+   delete static_cast<follib_buf *>(userData);
+}
+
+
+/*
+ * FiberSocketWriter::WriteBuf --
+ *
+ *      Write the first 'len' bytes of 'buf' and hand the buffer over to the
+ *      socket, which frees it once it's done with it. Nothing is copied, even
+ *      corked. Above the zero-copy threshold, the write is sent with
+ *      MSG_ZEROCOPY but only waits for the data to be on the wire, not for
+ *      the kernel to release the pages: the next buffer comes from the pool.
+ */
+bool
+FiberSocketWriter::WriteBuf(follib_buf buf,
+                            size_t     len)
+{
+   const bool zeroCopy = zcThreshold_ > 0 && len >= zcThreshold_;
+
+   if (!sock_) {
+      return false;
+   }
+
+   auto owned = new follib_buf(std::move(buf));
+   auto iobuf = folly::IOBuf::takeOwnership(owned->data(), owned->size(), len,
+                                            FiberSocketWriter_FreeBuf, owned);
+   Waiter waiter;
+
+   DCHECK_LE(len, iobuf->capacity());
+
+   if (cork_) {
+      if (failed_) {
+         return false;
+      }
+      if (!zeroCopy) {
+         pending_.append(std::move(iobuf));
+         return Corked();
+      }
+      Send();
+   }
+
+   sock_->writeChain(&waiter, std::move(iobuf),
+                     zeroCopy ? folly::WriteFlags::WRITE_MSG_ZEROCOPY :
+                                folly::WriteFlags::NONE);
+   waiter.baton.wait();
+   return waiter.ok;
+}
+
+
+/*
+ * Follib_Read --
+ *
+ *      Fill 'buf' with exactly 'len' bytes from the socket. Returns -1 on EOF
+ *      or close.
+ */
+ssize_t
+Follib_Read(FiberSocketReader *reader,
+            void              *buf,
+            size_t             len)
+{
+   ssize_t res;
+
+   res = reader->ReadExact(buf, len);
+
+   FLOGS(FOLLIB_LOG_NET, 2, "Just read %zd bytes.\n", res);
+
+   return res;
+}
+
+
+/*
+ * Follib_ReadTimeout --
+ *
+ *      Same as Follib_Read() but fails with ETIMEDOUT if 'len' bytes haven't
+ *      come in within 'timeout'. What did come in stays buffered.
+ */
+ssize_t
+Follib_ReadTimeout(FiberSocketReader        *reader,
+                   void                     *buf,
+                   size_t                    len,
+                   std::chrono::milliseconds timeout)
+{
+   const auto saved = reader->GetTimeout();
+   ssize_t res;
+
+   reader->SetTimeout(timeout);
+   res = reader->ReadExact(buf, len);
+   reader->SetTimeout(saved);
+
+   if (res < 0 && reader->TimedOut()) {
+      errno = ETIMEDOUT;
+   }
+   FLOGS(FOLLIB_LOG_NET, 2, "Just read %zd bytes.\n", res);
+
+   return res;
+}
+
+
+bool
+Follib_Write(FiberSocketWriter *writer,
+             const void        *buf,
+             size_t             len)
+{
+   FLOGS(FOLLIB_LOG_NET, 2, "Writing %zu bytes.\n", len);
+
+   return writer->Write(buf, len);
+}
+
+
+bool
+Follib_Writev(FiberSocketWriter  *writer,
+              const struct iovec *iov,
+              int                 iovcnt)
+{
+   FLOGS(FOLLIB_LOG_NET, 2, "Writing %d iovecs.\n", iovcnt);
+
+   return writer->Writev(iov, iovcnt);
+}
+
+
+bool
+Follib_WriteBuf(FiberSocketWriter *writer,
+                follib_buf         buf,
+                size_t             len)
+{
+   FLOGS(FOLLIB_LOG_NET, 2, "Writing %zu bytes from a follib_buf.\n", len);
+
+   return writer->WriteBuf(std::move(buf), len);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <folly/fibers/Baton.h>
+#include <folly/io/IOBuf.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/AsyncSocket.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/io/async/HHWheelTimer.h>
+
+#include "follib_buf.h"
+
+/*
+ * Buffered reader for an AsyncSocket, to be used from fibers of the
+ * socket's manager. It stays installed as the socket's read callback and
+ * reads as much as is available on every event into an IOBuf queue; the
+ * Read*() calls are served from that queue and only park the fiber when it
+ * doesn't hold enough yet. Reading pauses once 'maxBuffered' bytes are
+ * queued and nobody needs more.
+ *
+ * With SetTimeout(), a Read*() call fails once it has waited that long in
+ * total, after which TimedOut() is true until the next call. Whatever was
+ * buffered so far stays in the queue.
+ *
+ * A socket error ends the stream like EOF does; Failed() tells them apart.
+ */
+class FiberSocketReader : public folly::AsyncReader::ReadCallback,
+                          private folly::HHWheelTimer::Callback {
+public:
+   static const size_t kDefaultMaxBuffered = 256 * 1024;
+   static const size_t kFrameHdrSize       = 4;   // big-endian length
+
+   explicit FiberSocketReader(size_t maxBuffered = kDefaultMaxBuffered)
+      : maxBuffered_(maxBuffered) { }
+
+   void Attach(folly::AsyncSocket *sock);
+   void Close();
+   void SetTimeout(std::chrono::milliseconds timeout) { timeout_ = timeout; }
+
+   std::chrono::milliseconds GetTimeout() const { return timeout_; }
+
+   ssize_t                       ReadExact(void *buf, size_t len);
+   std::unique_ptr<folly::IOBuf> ReadExact(size_t len);
+   bool                          ReadLine(std::string *line,
+                                          size_t       maxLen = 4096);
+   std::unique_ptr<folly::IOBuf> ReadFrame(size_t maxLen = 1 << 20);
+
+   size_t Buffered() const { return queue_.chainLength(); }
+   bool   IsEOF() const { return eof_; }
+   bool   Failed() const { return failed_; }
+   bool   TimedOut() const { return timedOut_; }
+
+   void getReadBuffer(void **bufPtr, size_t *lenPtr) override;
+   void readDataAvailable(size_t readLen) noexcept override;
+   void readEOF() noexcept override;
+   void readErr(const folly::AsyncSocketException& ex) noexcept override;
+
+private:
+   class Deadline;
+
+   bool WaitFor(size_t len);
+   bool FindEOL(size_t *eol);
+   void Consumed(size_t len);
+   void Wake();
+   void timeoutExpired() noexcept override;
+   void callbackCanceled() noexcept override { }
+
+   folly::AsyncSocket   *sock_{nullptr};
+   folly::IOBufQueue     queue_{folly::IOBufQueue::cacheChainLength()};
+   folly::fibers::Baton  baton_;
+   size_t                need_{0};        // what the parked fiber waits for
+   size_t                maxBuffered_;
+   size_t                lineScanned_{0}; // leading bytes known to hold no EOL
+   bool                  eof_{false};
+   bool                  failed_{false};  // eof_ was set by a read error
+   bool                  closed_{false};
+   bool                  paused_{false};
+   bool                  timedOut_{false};
+   uint32_t              deadlineDepth_{0}; // nested Read*() calls
+   std::chrono::milliseconds timeout_{0};    // 0: none
+};
+
+
+/*
+ * Fiber-blocking writes on an AsyncSocket. An uncorked write parks the
+ * calling fiber until the socket reports the data written or failed, so the
+ * buffers only have to live for the duration of the call and are not copied.
+ *
+ * In cork mode, writes are copied to a pending chain and return right away;
+ * everything written during one event loop iteration goes out as a single
+ * writeChain at the end of the iteration. Flush() waits for it to be on the
+ * wire. The socket has to be destroyed before the writer.
+ *
+ * With SetZeroCopy(), writes of at least the threshold are sent with
+ * MSG_ZEROCOPY: the kernel pins the pages instead of copying them, and the
+ * write only returns once the kernel has released them, so the caller can
+ * refill the buffer right away. Destroying the socket releases them too.
+ * WriteBuf() hands a follib_buf over instead; it goes back to its pool once
+ * the socket is done with it, and the call doesn't wait for the kernel.
+ */
+class FiberSocketWriter : private folly::EventBase::LoopCallback,
+                          private folly::AsyncWriter::WriteCallback {
+public:
+   static const size_t kMaxCorked = 256 * 1024;
+
+   void Attach(folly::AsyncSocket *sock);
+   void Detach();
+   void SetCork(bool cork);
+   bool SetZeroCopy(size_t threshold);
+
+   bool Write(const void *buf, size_t len);
+   bool Writev(const struct iovec *iov, int iovcnt);
+   bool WriteBuf(follib_buf buf, size_t len);
+   bool Flush();
+
+private:
+   struct Waiter;
+   struct ZeroCopyWaiter;
+   struct FlushWaiter;
+
+   bool WriteZeroCopy(const struct iovec *iov, int iovcnt);
+   bool Corked();
+   void Send();
+   void BatchDone();
+   void runLoopCallback() noexcept override;
+   void writeSuccess() noexcept override;
+   void writeErr(size_t                            bytesWritten,
+                 const folly::AsyncSocketException& ex) noexcept override;
+
+   folly::AsyncSocket   *sock_{nullptr};
+   bool                  cork_{false};
+   bool                  failed_{false};
+   size_t                zcThreshold_{0};     // 0: no zero-copy
+   folly::IOBufQueue     pending_{folly::IOBufQueue::cacheChainLength()};
+   uint32_t              numInFlight_{0};     // corked chains being written
+   FlushWaiter          *flushWaiters_{nullptr};
+};
+
+
+ssize_t
+Follib_Read(FiberSocketReader *reader,
+            void              *buf,
+            size_t             len);
+
+ssize_t
+Follib_ReadTimeout(FiberSocketReader        *reader,
+                   void                     *buf,
+                   size_t                    len,
+                   std::chrono::milliseconds timeout);
+
+bool
+Follib_Write(FiberSocketWriter *writer,
+             const void        *buf,
+             size_t             len);
+
+bool
+Follib_Writev(FiberSocketWriter  *writer,
+              const struct iovec *iov,
+              int                 iovcnt);
+
+bool
+Follib_WriteBuf(FiberSocketWriter *writer,
+                follib_buf         buf,
+                size_t             len);
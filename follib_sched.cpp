@@ -0,0 +1,469 @@
+#include <stdlib.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <new>
+
+#include <folly/Random.h>
+#include <folly/SpinLock.h>
+#include <folly/fibers/FiberManager.h>
+
+#include "follib.h"
+#include "follib_int.h"
+#include "follib_sched.h"
+
+/*
+ * Work stealing
+ *
+ * A migratable task is pushed on the deque of the manager that spawned it
+ * along with a local runner fiber that pops one task when it gets to run. A
+ * manager with no migratable work pending and fewer than kWsMaxRunning tasks
+ * running is considered idle: on spawn, one idle sibling is poked with a
+ * thief fiber that takes the newest tasks from the busiest deque. Each
+ * stolen task runs on a fiber of its own, so that one parking on i/o or a
+ * lock doesn't hold up the others, and stealing goes on as they complete,
+ * for as long as the thief's manager stays idle. Tasks never move once
+ * started, and a local runner that finds its deque empty (its task was
+ * stolen) just returns.
+ *
+ * The deque lock is only ever contended by thieves.
+ */
+struct follib_ws_queue {
+   folly::SpinLock               lock;
+   std::deque<follib_task_func>  tasks;
+   std::atomic<uint32_t>         numQueued{0};
+   std::atomic<uint32_t>         numRunning{0};
+   std::atomic<bool>             thiefPending{false};
+
+   std::atomic<uint64_t>         numSpawned{0};
+   std::atomic<uint64_t>         numRun{0};
+   std::atomic<uint64_t>         numStolen{0};
+   std::atomic<uint64_t>         numThiefWakeups{0};
+};
+
+static const uint32_t kWsMaxRunning = 8;
+
+
+static inline void
+follib_ws_inc(std::atomic<uint64_t> *counter)
+{
+   counter->store(counter->load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+
+follib_ws_queue *
+follib_ws_queue_create()
+{
+   return new follib_ws_queue;
+}
+
+
+void
+follib_ws_queue_destroy(follib_ws_queue *q)
+{
+   DCHECK(q->tasks.empty());
+   delete q;
+}
+
+
+static bool
+follib_ws_pop_front(follib_ws_queue  *q,
+                    follib_task_func *func)
+{
+   std::lock_guard<folly::SpinLock> guard(q->lock);
+
+   if (q->tasks.empty()) {
+      return false;
+   }
+   *func = std::move(q->tasks.front());
+   q->tasks.pop_front();
+   q->numQueued.store(q->tasks.size(), std::memory_order_relaxed);
+   return true;
+}
+
+
+static bool
+follib_ws_pop_back(follib_ws_queue  *q,
+                   follib_task_func *func)
+{
+   std::lock_guard<folly::SpinLock> guard(q->lock);
+
+   if (q->tasks.empty()) {
+      return false;
+   }
+   *func = std::move(q->tasks.back());
+   q->tasks.pop_back();
+   q->numQueued.store(q->tasks.size(), std::memory_order_relaxed);
+   return true;
+}
+
+
+/*
+ * follib_ws_steal --
+ *
+ *      Take a task from the sibling with the longest deque.
+ */
+static bool
+follib_ws_steal(fiber_mgr        *mgr,
+                follib_task_func *func)
+{
+   const uint32_t n = follib_get_num_managers();
+
+   while (true) {
+      follib_ws_queue *victim = nullptr;
+      uint32_t maxQueued = 0;
+
+      for (uint32_t i = 0; i < n; i++) {
+         follib_ws_queue *q = follib_get_mgr_by_idx(i)->wsQueue;
+         uint32_t numQueued = q->numQueued.load(std::memory_order_relaxed);
+
+         if (i != mgr->idx && numQueued > maxQueued) {
+            victim = q;
+            maxQueued = numQueued;
+         }
+      }
+      if (!victim) {
+         return false;
+      }
+      if (follib_ws_pop_back(victim, func)) {
+         follib_ws_inc(&mgr->wsQueue->numStolen);
+         return true;
+      }
+   }
+}
+
+
+static void
+follib_ws_run_one(fiber_mgr        *mgr,
+                  follib_task_func *func)
+{
+   follib_ws_queue *q = mgr->wsQueue;
+
+   q->numRunning.fetch_add(1, std::memory_order_relaxed);
+   (*func)();
+   *func = nullptr;
+   q->numRunning.fetch_sub(1, std::memory_order_relaxed);
+   follib_ws_inc(&q->numRun);
+}
+
+
+/*
+ * follib_ws_local_runner --
+ *
+ *      Fiber added along with every spawn: runs the oldest local task.
+ */
+static void
+follib_ws_local_runner()
+{
+   fiber_mgr *mgr = follib_get_mgr();
+   follib_task_func func;
+
+   if (follib_ws_pop_front(mgr->wsQueue, &func)) {
+      follib_ws_run_one(mgr, &func);
+   }
+}
+
+
+static void follib_ws_steal_some(fiber_mgr *mgr);
+
+
+/*
+ * follib_ws_spawn_stolen --
+ *
+ *      Run a stolen task on a fiber of its own, then steal some more if the
+ *      manager is still idle.
+ */
+static void
+follib_ws_spawn_stolen(fiber_mgr        *mgr,
+                       follib_task_func  func)
+{
+   mgr->wsQueue->numRunning.fetch_add(1, std::memory_order_relaxed);
+
+   mgr->manager->addTask([mgr, func = std::move(func)]() mutable {
+      follib_ws_queue *q = mgr->wsQueue;
+
+      func();
+      func = nullptr;
+      q->numRunning.fetch_sub(1, std::memory_order_relaxed);
+      follib_ws_inc(&q->numRun);
+
+      follib_ws_steal_some(mgr);
+   });
+}
+
+
+/*
+ * follib_ws_steal_some --
+ *
+ *      Steal until there is local work, enough tasks running or nothing
+ *      left to steal.
+ */
+static void
+follib_ws_steal_some(fiber_mgr *mgr)
+{
+   follib_ws_queue *q = mgr->wsQueue;
+   follib_task_func func;
+
+   while (q->numQueued.load(std::memory_order_relaxed) == 0 &&
+          q->numRunning.load(std::memory_order_relaxed) < kWsMaxRunning &&
+          follib_ws_steal(mgr, &func)) {
+      follib_ws_spawn_stolen(mgr, std::move(func));
+   }
+}
+
+
+/*
+ * follib_ws_thief --
+ *
+ *      Fiber sent to an idle manager.
+ */
+static void
+follib_ws_thief()
+{
+   fiber_mgr *mgr = follib_get_mgr();
+
+   mgr->wsQueue->thiefPending.store(false, std::memory_order_relaxed);
+   follib_ws_steal_some(mgr);
+}
+
+
+/*
+ * follib_ws_poke_idle --
+ *
+ *      Send a thief to one idle sibling, if any.
+ */
+static void
+follib_ws_poke_idle(fiber_mgr *mgr)
+{
+   const uint32_t n = follib_get_num_managers();
+
+   for (uint32_t k = 1; k < n; k++) {
+      fiber_mgr *sibling = follib_get_mgr_by_idx((mgr->idx + k) % n);
+      follib_ws_queue *q = sibling->wsQueue;
+      bool expected = false;
+
+      if (q->numQueued.load(std::memory_order_relaxed) != 0 ||
+          q->numRunning.load(std::memory_order_relaxed) >= kWsMaxRunning) {
+         continue;
+      }
+      if (q->thiefPending.compare_exchange_strong(expected, true)) {
+         follib_ws_inc(&q->numThiefWakeups);
+         sibling->manager->addTaskRemote([]() {
+            follib_stats_remote_task();
+            follib_ws_thief();
+         });
+         return;
+      }
+   }
+}
+
+
+/*
+ * follib_spawn_migratable --
+ *
+ *      Spawn a task on the calling manager that an idle sibling may take over
+ *      as long as it hasn't started. Without follib_options::workStealing
+ *      this is a plain addTask().
+ */
+void
+follib_spawn_migratable(follib_task_func func)
+{
+   fiber_mgr *mgr = follib_get_mgr();
+   follib_ws_queue *q = mgr->wsQueue;
+
+   if (!q) {
+      mgr->manager->addTask(std::move(func));
+      return;
+   }
+
+   {
+      std::lock_guard<folly::SpinLock> guard(q->lock);
+
+      q->tasks.push_back(std::move(func));
+      q->numQueued.store(q->tasks.size(), std::memory_order_relaxed);
+   }
+   follib_ws_inc(&q->numSpawned);
+
+   mgr->manager->addTask([]() { follib_ws_local_runner(); });
+   follib_ws_poke_idle(mgr);
+}
+
+
+void
+follib_sched_get_stats(uint32_t            idx,
+                       follib_sched_stats *stats)
+{
+   follib_ws_queue *q = follib_get_mgr_by_idx(idx)->wsQueue;
+
+   if (!q) {
+      *stats = follib_sched_stats();
+      return;
+   }
+   stats->numSpawned      = q->numSpawned.load(std::memory_order_relaxed);
+   stats->numRun          = q->numRun.load(std::memory_order_relaxed);
+   stats->numStolen       = q->numStolen.load(std::memory_order_relaxed);
+   stats->numThiefWakeups = q->numThiefWakeups.load(std::memory_order_relaxed);
+}
+
+
+/*
+ * Connection placement
+ *
+ * The placer counts the connections it put on each manager until they are
+ * released, one cache line per manager since placing and releasing happen on
+ * different threads. The load of a manager is read from its runtime counters,
+ * which are only refreshed once per loop iteration: a burst of connections
+ * accepted in one go would all land on the same least loaded manager. So a
+ * manager is scored on its load plus its connection count, which every
+ * placement bumps right away, and two random choices spread bursts best.
+ */
+struct follib_place_slot {
+   std::atomic<uint32_t> numConns{0};
+   char                  pad[64 - sizeof(std::atomic<uint32_t>)];
+};
+
+struct follib_placer {
+   follib_place_policy    policy;
+   uint32_t               firstIdx;
+   uint32_t               numMgrs;
+   std::atomic<uint32_t>  next{0};
+   follib_place_slot     *slots{nullptr};   // by manager
+};
+
+
+follib_placer *
+follib_placer_create(follib_place_policy policy,
+                     uint32_t            firstIdx)
+{
+   const uint32_t n = follib_get_num_managers();
+   auto placer = new follib_placer;
+   void *p;
+
+   placer->policy = policy;
+   placer->numMgrs = n;
+   placer->firstIdx = firstIdx < n ? firstIdx : 0;
+   if (posix_memalign(&p, 64, n * sizeof(follib_place_slot)) != 0) {
+      delete placer;
+      throw std::bad_alloc();
+   }
+   placer->slots = static_cast<follib_place_slot *>(p);
+   for (uint32_t i = 0; i < n; i++) {
+      new (&placer->slots[i]) follib_place_slot();
+   }
+   return placer;
+}
+
+
+void
+follib_placer_destroy(follib_placer *placer)
+{
+   free(placer->slots);
+   delete placer;
+}
+
+
+/*
+ * follib_place_load --
+ *
+ *      Work waiting on a manager: fibers ready to run and file i/os in
+ *      flight or queued, as of its last loop iteration.
+ */
+static uint64_t
+follib_place_load(uint32_t idx)
+{
+   const follib_mgr_counters& c = follib_get_mgr_by_idx(idx)->counters;
+
+   return c.runQueueLen.load(std::memory_order_relaxed) +
+          c.ioInFlight.load(std::memory_order_relaxed) +
+          c.ioQueued.load(std::memory_order_relaxed);
+}
+
+
+/*
+ * follib_place_score --
+ *
+ *      How busy manager 'idx' is, lower is better: the connections placed on
+ *      it, plus its queued work with 'useLoad'. A connection weighs as much
+ *      as a ready fiber or a file i/o.
+ */
+static inline uint64_t
+follib_place_score(follib_placer *placer,
+                   uint32_t       idx,
+                   bool           useLoad)
+{
+   uint64_t score = placer->slots[idx].numConns.load(std::memory_order_relaxed);
+
+   if (useLoad) {
+      score += follib_place_load(idx);
+   }
+   return score;
+}
+
+
+/*
+ * follib_place --
+ *
+ *      Pick the manager for a new connection and count it there until
+ *      follib_place_release(). Callable from any thread.
+ */
+uint32_t
+follib_place(follib_placer *placer)
+{
+   const uint32_t first = placer->firstIdx;
+   const uint32_t range = placer->numMgrs - first;
+   uint32_t best = first;
+
+   switch (placer->policy) {
+   case FOLLIB_PLACE_ROUND_ROBIN:
+      best = first + placer->next.fetch_add(1, std::memory_order_relaxed) % range;
+      break;
+
+   case FOLLIB_PLACE_LEAST_CONNS:
+   case FOLLIB_PLACE_LEAST_LOADED: {
+      const bool useLoad = placer->policy == FOLLIB_PLACE_LEAST_LOADED;
+      uint64_t bestScore = follib_place_score(placer, best, useLoad);
+
+      for (uint32_t i = first + 1; i < placer->numMgrs; i++) {
+         uint64_t score = follib_place_score(placer, i, useLoad);
+
+         if (score < bestScore) {
+            best = i;
+            bestScore = score;
+         }
+      }
+      break;
+   }
+
+   case FOLLIB_PLACE_TWO_CHOICES:
+      if (range > 1) {
+         uint32_t a = first + folly::Random::rand32(range);
+         uint32_t b = first + (a - first + 1 + folly::Random::rand32(range - 1)) % range;
+
+         best = follib_place_score(placer, a, true) <=
+                follib_place_score(placer, b, true) ? a : b;
+      }
+      break;
+   }
+
+   placer->slots[best].numConns.fetch_add(1, std::memory_order_relaxed);
+   return best;
+}
+
+
+void
+follib_place_release(follib_placer *placer,
+                     uint32_t       idx)
+{
+   DCHECK_GT(placer->slots[idx].numConns.load(), 0u);
+   placer->slots[idx].numConns.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+uint32_t
+follib_place_num_conns(follib_placer *placer,
+                       uint32_t       idx)
+{
+   return placer->slots[idx].numConns.load(std::memory_order_relaxed);
+}
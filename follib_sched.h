@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+#include <folly/Function.h>
+
+typedef folly::Function<void()> follib_task_func;
+
+/*
+ * Work-stealing counters of one manager.
+ */
+struct follib_sched_stats {
+   uint64_t numSpawned;      // migratable tasks spawned here
+   uint64_t numRun;          // migratable tasks run here, stolen ones included
+   uint64_t numStolen;       // tasks this manager took from a sibling
+   uint64_t numThiefWakeups; // times this manager was poked to go steal
+};
+
+void follib_spawn_migratable(follib_task_func func);
+void follib_sched_get_stats(uint32_t idx, follib_sched_stats *stats);
+
+
+/*
+ * Connection placement: picks the manager that hosts a new connection, out
+ * of managers [firstIdx, n).
+ */
+enum follib_place_policy {
+   FOLLIB_PLACE_ROUND_ROBIN,
+   FOLLIB_PLACE_LEAST_CONNS,   // fewest connections placed and not released
+   FOLLIB_PLACE_LEAST_LOADED,  // least queued work (ready fibers, file i/os) + conns
+   FOLLIB_PLACE_TWO_CHOICES,   // same score, best of two managers picked at random
+};
+
+struct follib_placer;
+
+follib_placer *follib_placer_create(follib_place_policy policy,
+                                    uint32_t            firstIdx = 0);
+void     follib_placer_destroy(follib_placer *placer);
+uint32_t follib_place(follib_placer *placer);
+void     follib_place_release(follib_placer *placer, uint32_t idx);
+uint32_t follib_place_num_conns(follib_placer *placer, uint32_t idx);
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+
+#include <new>
+#include <thread>
+
+#include <folly/fibers/FiberManager.h>
+
+#include "follib_sync.h"
+
+/*
+ * Slow paths of the fiber locks. The spinlock is only held to update the
+ * lock state and the wait queues; batons are posted after dropping it.
+ */
+
+
+/*
+ * follib_sync_wake --
+ *
+ *      Post every waiter of a detached list. A waiter may be gone as soon as
+ *      it's posted, so grab 'next' first.
+ */
+static void
+follib_sync_wake(follib_sync_waiter *waiter)
+{
+   while (waiter) {
+      follib_sync_waiter *next = waiter->next;
+
+      waiter->baton.post();
+      waiter = next;
+   }
+}
+
+
+/*
+ * follib_rw_lock_grant --
+ *
+ *      The lock just became free: hand it over to the next writer or to all
+ *      the waiting readers, according to the priority mode. Returns the
+ *      waiters to wake. Called with the spinlock held.
+ */
+static follib_sync_waiter *
+follib_rw_lock_grant(follib_rw_lock *rwLock)
+{
+   follib_sync_waiter *list;
+   bool toWriter;
+
+   DCHECK_EQ(rwLock->numReaders, 0);
+
+   if (rwLock->prio == FOLLIB_RW_LOCK_PRIO_WRITE) {
+      toWriter = rwLock->writers.num > 0;
+   } else {
+      toWriter = rwLock->readers.num == 0 && rwLock->writers.num > 0;
+   }
+
+   if (toWriter) {
+      rwLock->numReaders = -1;
+      return follib_sync_queue_pop(&rwLock->writers);
+   }
+
+   list = rwLock->readers.head;
+   rwLock->numReaders = rwLock->readers.num;
+   rwLock->readers = follib_sync_queue();
+   return list;
+}
+
+
+/*
+ * follib_rw_lock_rd_lock_slow --
+ *
+ *      Park until the lock is handed to us for reading.
+ */
+void
+follib_rw_lock_rd_lock_slow(follib_rw_lock *rwLock)
+{
+   follib_sync_waiter waiter;
+
+   rwLock->spin.lock();
+   if (rwLock->numReaders >= 0 &&
+       (rwLock->prio == FOLLIB_RW_LOCK_PRIO_READ || rwLock->writers.num == 0)) {
+      rwLock->numReaders++;
+      rwLock->spin.unlock();
+      return;
+   }
+   follib_sync_queue_push(&rwLock->readers, &waiter);
+   rwLock->spin.unlock();
+
+   waiter.baton.wait();
+}
+
+
+/*
+ * follib_rw_lock_wr_lock_slow --
+ *
+ *      Park until the lock is handed to us for writing.
+ */
+void
+follib_rw_lock_wr_lock_slow(follib_rw_lock *rwLock)
+{
+   follib_sync_waiter waiter;
+
+   rwLock->spin.lock();
+   if (rwLock->numReaders == 0) {
+      rwLock->numReaders = -1;
+      rwLock->spin.unlock();
+      return;
+   }
+   follib_sync_queue_push(&rwLock->writers, &waiter);
+   rwLock->spin.unlock();
+
+   waiter.baton.wait();
+}
+
+
+void
+follib_rw_lock_rd_unlock(follib_rw_lock *rwLock)
+{
+   follib_sync_waiter *toWake = nullptr;
+
+   rwLock->spin.lock();
+   DCHECK_GT(rwLock->numReaders, 0);
+   if (--rwLock->numReaders == 0) {
+      toWake = follib_rw_lock_grant(rwLock);
+   }
+   rwLock->spin.unlock();
+
+   follib_sync_wake(toWake);
+}
+
+
+void
+follib_rw_lock_wr_unlock(follib_rw_lock *rwLock)
+{
+   follib_sync_waiter *toWake;
+
+   rwLock->spin.lock();
+   DCHECK_EQ(rwLock->numReaders, -1);
+   rwLock->numReaders = 0;
+   toWake = follib_rw_lock_grant(rwLock);
+   rwLock->spin.unlock();
+
+   follib_sync_wake(toWake);
+}
+
+
+/*
+ * follib_mutex_lock_slow --
+ *
+ *      Park until the mutex is handed to us.
+ */
+void
+follib_mutex_lock_slow(follib_mutex *mutex)
+{
+   follib_sync_waiter waiter;
+
+   mutex->spin.lock();
+   if (!mutex->locked) {
+      mutex->locked = true;
+      mutex->spin.unlock();
+      return;
+   }
+   follib_sync_queue_push(&mutex->waiters, &waiter);
+   mutex->spin.unlock();
+
+   waiter.baton.wait();
+}
+
+
+void
+follib_mutex_unlock(follib_mutex *mutex)
+{
+   follib_sync_waiter *toWake = nullptr;
+
+   mutex->spin.lock();
+   DCHECK(mutex->locked);
+   if (mutex->waiters.num > 0) {
+      toWake = follib_sync_queue_pop(&mutex->waiters);
+   } else {
+      mutex->locked = false;
+   }
+   mutex->spin.unlock();
+
+   follib_sync_wake(toWake);
+}
+
+
+/*
+ * follib_sharded_rw_lock_init --
+ *
+ *      One slot per manager plus the shared one, so this has to be called
+ *      after follib_init().
+ */
+void
+follib_sharded_rw_lock_init(follib_sharded_rw_lock *rwLock)
+{
+   void *p;
+
+   follib_mutex_init(&rwLock->wrMutex);
+   rwLock->writer = false;
+   rwLock->numSlots = follib_get_num_managers() + 1;
+   if (posix_memalign(&p, 64, rwLock->numSlots * sizeof(follib_rw_slot)) != 0) {
+      throw std::bad_alloc();
+   }
+   rwLock->slots = static_cast<follib_rw_slot *>(p);
+   for (uint32_t i = 0; i < rwLock->numSlots; i++) {
+      new (&rwLock->slots[i]) follib_rw_slot();
+   }
+}
+
+
+void
+follib_sharded_rw_lock_exit(follib_sharded_rw_lock *rwLock)
+{
+   for (uint32_t i = 0; i < rwLock->numSlots; i++) {
+      DCHECK_EQ(rwLock->slots[i].numReaders.load(), 0u);
+   }
+   DCHECK(!rwLock->writer.load());
+   follib_mutex_exit(&rwLock->wrMutex);
+   free(rwLock->slots);
+   rwLock->slots = nullptr;
+   rwLock->numSlots = 0;
+}
+
+
+/*
+ * follib_sharded_rw_lock_rd_lock_slow --
+ *
+ *      A writer is in: back off from our slot and queue behind it on the
+ *      writers' mutex. Once we own the mutex no writer can be in, so it is
+ *      safe to count ourselves in again before handing the mutex on.
+ */
+void
+follib_sharded_rw_lock_rd_lock_slow(follib_sharded_rw_lock *rwLock,
+                                    follib_rw_slot         *slot)
+{
+   slot->numReaders.fetch_sub(1, std::memory_order_release);
+
+   follib_mutex_lock(&rwLock->wrMutex);
+   slot->numReaders.fetch_add(1);
+   follib_mutex_unlock(&rwLock->wrMutex);
+}
+
+
+/*
+ * follib_sharded_rw_lock_wr_lock --
+ *
+ *      Keep new readers out then wait for every slot to drain, yielding so
+ *      that readers on our own manager get to finish.
+ */
+void
+follib_sharded_rw_lock_wr_lock(follib_sharded_rw_lock *rwLock)
+{
+   follib_mutex_lock(&rwLock->wrMutex);
+   rwLock->writer.store(true);
+
+   for (uint32_t i = 0; i < rwLock->numSlots; i++) {
+      while (rwLock->slots[i].numReaders.load() != 0) {
+         if (folly::fibers::onFiber()) {
+            folly::fibers::yield();
+         } else {
+            std::this_thread::yield();
+         }
+      }
+   }
+}
+
+
+void
+follib_sharded_rw_lock_wr_unlock(follib_sharded_rw_lock *rwLock)
+{
+   rwLock->writer.store(false, std::memory_order_release);
+   follib_mutex_unlock(&rwLock->wrMutex);
+}
@@ -1,52 +1,281 @@
 #pragma once
 
-#include <folly/SharedMutex.h>
+#include <atomic>
+#include <cstdint>
+
+#include <folly/Likely.h>
+#include <folly/SpinLock.h>
+#include <folly/fibers/Baton.h>
+#include <glog/logging.h>
+
+#include "follib.h"
+
+/*
+ * Fiber-aware locks. A contended acquire only parks the calling fiber on a
+ * Baton, so the other fibers of its manager keep running; off a fiber the
+ * Baton blocks the thread instead. Waiters may live on any manager.
+ *
+ * Ownership is handed over directly by the unlocker to the waiters it wakes,
+ * in FIFO order, so a woken waiter never has to retry.
+ */
+
+struct follib_sync_waiter {
+   folly::fibers::Baton  baton;
+   follib_sync_waiter   *next{nullptr};
+};
+
+/*
+ * FIFO of parked waiters.
+ */
+struct follib_sync_queue {
+   follib_sync_waiter *head{nullptr};
+   follib_sync_waiter *tail{nullptr};
+   uint32_t            num{0};
+};
+
+
+static inline void
+follib_sync_queue_push(follib_sync_queue  *q,
+                       follib_sync_waiter *waiter)
+{
+   waiter->next = nullptr;
+   if (q->tail) {
+      q->tail->next = waiter;
+   } else {
+      q->head = waiter;
+   }
+   q->tail = waiter;
+   q->num++;
+}
+
+
+static inline follib_sync_waiter *
+follib_sync_queue_pop(follib_sync_queue *q)
+{
+   follib_sync_waiter *waiter = q->head;
+
+   q->head = waiter->next;
+   if (!q->head) {
+      q->tail = nullptr;
+   }
+   q->num--;
+   waiter->next = nullptr;
+   return waiter;
+}
+
 
 /*
- * libfolly doesn't distinguish between mutex and rw locks. That makes our
- * life easier since we have a single type to manipulate.
+ * follib_sync_queue_remove --
+ *
+ *      Unlink 'waiter' wherever it is in the queue. Returns false if it
+ *      isn't there anymore, i.e. it has been popped to be woken.
  */
+static inline bool
+follib_sync_queue_remove(follib_sync_queue  *q,
+                         follib_sync_waiter *waiter)
+{
+   follib_sync_waiter *prev = nullptr;
+   follib_sync_waiter *cur = q->head;
 
-typedef folly::SharedMutexImpl<true> DSharedMutexReadPriority;
+   while (cur && cur != waiter) {
+      prev = cur;
+      cur = cur->next;
+   }
+   if (!cur) {
+      return false;
+   }
+   if (prev) {
+      prev->next = waiter->next;
+   } else {
+      q->head = waiter->next;
+   }
+   if (q->tail == waiter) {
+      q->tail = prev;
+   }
+   q->num--;
+   waiter->next = nullptr;
+   return true;
+}
+
+
+enum follib_rw_lock_prio {
+   FOLLIB_RW_LOCK_PRIO_READ,   // readers get in as long as no writer holds it
+   FOLLIB_RW_LOCK_PRIO_WRITE,  // a waiting writer holds off new readers
+};
 
 struct follib_rw_lock {
-   DSharedMutexReadPriority lock;
+   folly::SpinLock      spin;          // protects everything below
+   int32_t              numReaders{0}; // -1: write locked
+   follib_rw_lock_prio  prio{FOLLIB_RW_LOCK_PRIO_READ};
+   follib_sync_queue    readers;
+   follib_sync_queue    writers;
 };
 
+struct follib_mutex {
+   folly::SpinLock      spin;
+   bool                 locked{false};
+   follib_sync_queue    waiters;
+};
+
+/*
+ * Reader-sharded rw lock for read-mostly data. Each manager counts its
+ * readers on its own cache line, so readers on different managers never
+ * write to a shared line. A writer raises 'writer' and waits for every slot
+ * to drain, which makes writes expensive. Threads that aren't managers share
+ * one extra slot. Writers queue on a follib_mutex, and so do readers that
+ * run into a writer.
+ */
+struct follib_rw_slot {
+   std::atomic<uint32_t> numReaders{0};
+   char                  pad[64 - sizeof(std::atomic<uint32_t>)];
+};
+
+struct follib_sharded_rw_lock {
+   char                  pad0[64];
+   std::atomic<bool>     writer{false};
+   char                  pad1[64 - sizeof(std::atomic<bool>)];
+   follib_mutex          wrMutex;
+   uint32_t              numSlots{0};
+   follib_rw_slot       *slots{nullptr};
+};
+
+
+void follib_rw_lock_rd_lock_slow(follib_rw_lock *rwLock);
+void follib_rw_lock_wr_lock_slow(follib_rw_lock *rwLock);
+void follib_rw_lock_rd_unlock(follib_rw_lock *rwLock);
+void follib_rw_lock_wr_unlock(follib_rw_lock *rwLock);
+void follib_mutex_lock_slow(follib_mutex *mutex);
+void follib_mutex_unlock(follib_mutex *mutex);
+void follib_sharded_rw_lock_init(follib_sharded_rw_lock *rwLock);
+void follib_sharded_rw_lock_exit(follib_sharded_rw_lock *rwLock);
+void follib_sharded_rw_lock_rd_lock_slow(follib_sharded_rw_lock *rwLock,
+                                         follib_rw_slot         *slot);
+void follib_sharded_rw_lock_wr_lock(follib_sharded_rw_lock *rwLock);
+void follib_sharded_rw_lock_wr_unlock(follib_sharded_rw_lock *rwLock);
+
 
 static inline void
-follib_rw_lock_init(follib_rw_lock *rwLock)
+follib_rw_lock_init(follib_rw_lock      *rwLock,
+                    follib_rw_lock_prio  prio = FOLLIB_RW_LOCK_PRIO_READ)
 {
+   rwLock->numReaders = 0;
+   rwLock->prio = prio;
+}
+
+static inline bool
+follib_rw_lock_rd_trylock(follib_rw_lock *rwLock)
+{
+   bool ok;
+
+   rwLock->spin.lock();
+   ok = rwLock->numReaders >= 0 &&
+        (rwLock->prio == FOLLIB_RW_LOCK_PRIO_READ || rwLock->writers.num == 0);
+   if (ok) {
+      rwLock->numReaders++;
+   }
+   rwLock->spin.unlock();
+   return ok;
 }
 
 static inline void
 follib_rw_lock_rd_lock(follib_rw_lock *rwLock)
 {
-   rwLock->lock.lock_shared();
+   if (!follib_rw_lock_rd_trylock(rwLock)) {
+      follib_rw_lock_rd_lock_slow(rwLock);
+   }
 }
 
-static inline void
-follib_rw_lock_rd_unlock(follib_rw_lock *rwLock)
+static inline bool
+follib_rw_lock_wr_trylock(follib_rw_lock *rwLock)
 {
-   rwLock->lock.unlock_shared();
+   bool ok;
+
+   rwLock->spin.lock();
+   ok = rwLock->numReaders == 0;
+   if (ok) {
+      rwLock->numReaders = -1;
+   }
+   rwLock->spin.unlock();
+   return ok;
 }
 
 static inline void
 follib_rw_lock_wr_lock(follib_rw_lock *rwLock)
 {
-   rwLock->lock.lock();
+   if (!follib_rw_lock_wr_trylock(rwLock)) {
+      follib_rw_lock_wr_lock_slow(rwLock);
+   }
 }
 
 static inline void
-follib_rw_lock_wr_unlock(follib_rw_lock *rwLock)
+follib_rw_lock_exit(follib_rw_lock *rwLock)
 {
-   rwLock->lock.unlock();
+   DCHECK_EQ(rwLock->numReaders, 0);
+   DCHECK_EQ(rwLock->readers.num + rwLock->writers.num, 0u);
 }
 
+
 static inline void
-follib_rw_lock_exit(follib_rw_lock *rwLock)
+follib_mutex_init(follib_mutex *mutex)
 {
+   mutex->locked = false;
 }
 
+static inline bool
+follib_mutex_trylock(follib_mutex *mutex)
+{
+   bool ok;
 
+   mutex->spin.lock();
+   ok = !mutex->locked;
+   mutex->locked = true;
+   mutex->spin.unlock();
+   return ok;
+}
 
+static inline void
+follib_mutex_lock(follib_mutex *mutex)
+{
+   if (!follib_mutex_trylock(mutex)) {
+      follib_mutex_lock_slow(mutex);
+   }
+}
+
+static inline void
+follib_mutex_exit(follib_mutex *mutex)
+{
+   DCHECK(!mutex->locked);
+   DCHECK_EQ(mutex->waiters.num, 0u);
+}
+
+
+static inline follib_rw_slot *
+follib_sharded_rw_lock_slot(follib_sharded_rw_lock *rwLock)
+{
+   const uint32_t shared = rwLock->numSlots - 1;
+   const int idx = follib_get_mgr_idx_unsafe();
+
+   return &rwLock->slots[idx >= 0 && (uint32_t)idx < shared ? idx : shared];
+}
+
+/*
+ * The reader's increment and the writer's store of 'writer' are both
+ * sequentially consistent: either the writer sees the reader in its slot,
+ * or the reader sees the writer and backs off.
+ */
+static inline void
+follib_sharded_rw_lock_rd_lock(follib_sharded_rw_lock *rwLock)
+{
+   follib_rw_slot *slot = follib_sharded_rw_lock_slot(rwLock);
+
+   slot->numReaders.fetch_add(1);
+   if (FOLLY_UNLIKELY(rwLock->writer.load())) {
+      follib_sharded_rw_lock_rd_lock_slow(rwLock, slot);
+   }
+}
+
+static inline void
+follib_sharded_rw_lock_rd_unlock(follib_sharded_rw_lock *rwLock)
+{
+   follib_sharded_rw_lock_slot(rwLock)->numReaders.fetch_sub(1, std::memory_order_release);
+}
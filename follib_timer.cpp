@@ -0,0 +1,72 @@
+#include <thread>
+
+#include <folly/fibers/Baton.h>
+#include <folly/fibers/FiberManager.h>
+
+#include "follib.h"
+#include "follib_int.h"
+#include "follib_timer.h"
+
+/*
+ * A fiber parked in follib_sleep_for(). Tearing the wheel down wakes it too.
+ */
+struct follib_sleeper : public folly::HHWheelTimer::Callback {
+   void timeoutExpired() noexcept override {
+      baton.post();
+   }
+   void callbackCanceled() noexcept override {
+      baton.post();
+   }
+
+   folly::fibers::Baton baton;
+};
+
+
+/*
+ * follib_get_timer --
+ *
+ *      Return the timer wheel of the calling manager.
+ */
+folly::HHWheelTimer *
+follib_get_timer()
+{
+   return follib_get_mgr()->timer.get();
+}
+
+
+/*
+ * follib_sleep_for --
+ *
+ *      Park the calling fiber for 'timeout', letting the other fibers of its
+ *      manager run. Off a fiber on a manager thread, this runs the event loop
+ *      until then, which must not happen from inside the loop. Any other
+ *      thread just sleeps.
+ */
+void
+follib_sleep_for(std::chrono::milliseconds timeout)
+{
+   fiber_mgr *mgr = follib_get_mgr_unsafe();
+   follib_sleeper sleeper;
+
+   if (!mgr) {
+      std::this_thread::sleep_for(timeout);
+      return;
+   }
+   if (timeout.count() <= 0) {
+      if (folly::fibers::onFiber()) {
+         folly::fibers::yield();
+      }
+      return;
+   }
+
+   mgr->timer->scheduleTimeout(&sleeper, timeout);
+
+   if (folly::fibers::onFiber()) {
+      sleeper.baton.wait();
+      return;
+   }
+   DCHECK(!mgr->evb.isRunning());
+   while (!sleeper.baton.try_wait()) {
+      mgr->evb.loopOnce();
+   }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <chrono>
+
+#include <folly/io/async/HHWheelTimer.h>
+
+/*
+ * Every manager owns a hierarchical timer wheel on its event base, with a
+ * finer tick than the event base's own wheel (see follib_options). Callbacks
+ * are intrusive, so arming or cancelling a timer is O(1) and doesn't
+ * allocate, and the event base only ever waits for the nearest expiry: an
+ * armed timer costs nothing until it fires, however many there are. A wheel
+ * is only ever touched by its own manager.
+ */
+
+folly::HHWheelTimer *follib_get_timer();
+
+void follib_sleep_for(std::chrono::milliseconds timeout);
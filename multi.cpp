@@ -1,8 +1,14 @@
 #include "follib_log.h"
 
+#include "test_chan.h"
+#include "test_fib.h"
 #include "test_file_io.h"
 #include "test_net_server.h"
+#include "test_net_zc.h"
+#include "test_sched.h"
 #include "test_server.h"
+#include "test_sync.h"
+#include "test_timer.h"
 
 
 int
@@ -14,8 +20,20 @@ main(int argc, char* argv[])
 
    test_net_server();
 
+//   test_net_zc();
+
 //   test_server();
 
+//   test_sync();
+
+//   test_fib();
+
+//   test_timer();
+
+//   test_chan();
+
+//   test_sched();
+
    follib_log_exit();
 
    return 0;
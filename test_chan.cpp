@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <folly/fibers/Baton.h>
+
+#include "follib.h"
+#include "follib_chan.h"
+#include "test_chan.h"
+
+/*
+ * Fan-in benchmark: a fiber on every other manager streams integers to a
+ * fiber of manager 0, through a follib_chan one at a time or in batches,
+ * then with one addTaskRemote() per message for comparison. Each integer
+ * carries its sender in the high 32 bits and a sequence number in the low
+ * ones, so the receiver can tell a lost, duplicated or reordered item.
+ */
+
+static const uint64_t kChanMsgs  = 1000000;   // per sender
+static const uint32_t kChanBatch = 64;
+
+
+static double
+test_chan_ns_since(std::chrono::steady_clock::time_point start)
+{
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+
+/*
+ * test_chan_sender --
+ *
+ *      Send kChanMsgs integers tagged with 'sender', 'batch' at a time.
+ */
+static void
+test_chan_sender(follib_chan<uint64_t> *chan,
+                 uint32_t               sender,
+                 uint32_t               batch)
+{
+   const uint64_t tag = (uint64_t)sender << 32;
+   uint64_t items[kChanBatch];
+
+   for (uint64_t i = 0; i < kChanMsgs; i += batch) {
+      if (batch == 1) {
+         chan->send(tag | i);
+         continue;
+      }
+      for (uint32_t j = 0; j < batch; j++) {
+         items[j] = tag | (i + j);
+      }
+      chan->send_batch(items, batch);
+   }
+}
+
+
+/*
+ * test_chan_check --
+ *
+ *      Check that 'item' is the next one expected from its sender. Exits on
+ *      a stray sender or a gap, duplicate or reordering in its sequence.
+ */
+static void
+test_chan_check(std::vector<uint64_t> *nextSeq,
+                uint64_t               item)
+{
+   const uint64_t sender = item >> 32;
+   const uint64_t seq = item & 0xffffffff;
+
+   if (sender == 0 || sender >= nextSeq->size()) {
+      printf("%s: item 0x%lx from unknown sender\n", __func__, item);
+      exit(1);
+   }
+   if (seq != (*nextSeq)[sender]) {
+      printf("%s: sender %lu: got #%lu, expected #%lu\n", __func__,
+             sender, seq, (*nextSeq)[sender]);
+      exit(1);
+   }
+   (*nextSeq)[sender]++;
+}
+
+
+/*
+ * Runs on a fiber of manager 0.
+ */
+static void
+test_chan_bench(const char *name,
+                uint32_t    batch)
+{
+   const uint32_t numSenders = follib_get_num_managers() - 1;
+   const uint64_t total = numSenders * kChanMsgs;
+   follib_chan<uint64_t> chan(4096);
+   std::atomic<uint32_t> remaining{numSenders};
+   folly::fibers::Baton sendersDone;
+   std::vector<uint64_t> nextSeq(numSenders + 1);  // by sender, 0 unused
+   uint64_t items[kChanBatch];
+   uint64_t numRecv = 0;
+   uint64_t numRecvCalls = 0;
+   uint64_t extra;
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 1; i <= numSenders; i++) {
+      follib_get_manager(i)->addTaskRemote([&, i, batch]() {
+         follib_stats_remote_task();
+         test_chan_sender(&chan, i, batch);
+         if (remaining.fetch_sub(1) == 1) {
+            sendersDone.post();
+         }
+      });
+   }
+   while (numRecv < total) {
+      uint32_t n = chan.recv_batch(items, kChanBatch);
+
+      for (uint32_t i = 0; i < n; i++) {
+         test_chan_check(&nextSeq, items[i]);
+      }
+      numRecv += n;
+      numRecvCalls++;
+   }
+   sendersDone.wait();
+
+   double ns = test_chan_ns_since(start);
+
+   if (chan.try_recv(&extra)) {
+      printf("%s: unexpected item 0x%lx after the last one\n", __func__, extra);
+      exit(1);
+   }
+   for (uint32_t i = 1; i <= numSenders; i++) {
+      if (nextSeq[i] != kChanMsgs) {
+         printf("%s: sender %u: got %lu of %lu items\n", __func__, i,
+                nextSeq[i], kChanMsgs);
+         exit(1);
+      }
+   }
+
+   printf("%-12s %u senders: %6.1f ns per msg, %.1fM msgs/s, "
+          "%.2f msgs per recv, %.4f wakeups per msg\n", name, numSenders,
+          ns / total, total / ns * 1000, (double)total / numRecvCalls,
+          (double)chan.num_wakeups() / total);
+}
+
+
+/*
+ * test_chan_remote_task --
+ *
+ *      Same fan-in, with a closure posted to manager 0 per message. Runs on
+ *      a fiber of manager 0.
+ */
+static void
+test_chan_remote_task()
+{
+   const uint32_t numSenders = follib_get_num_managers() - 1;
+   const uint64_t numMsgs = kChanMsgs / 10;
+   const uint64_t total = numSenders * numMsgs;
+   folly::fibers::Baton done;
+   uint64_t numRecv = 0;
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 1; i <= numSenders; i++) {
+      follib_get_manager(i)->addTaskRemote([&]() {
+         follib_stats_remote_task();
+         for (uint64_t j = 0; j < numMsgs; j++) {
+            follib_get_manager(0)->addTaskRemote([&]() {
+               if (++numRecv == total) {
+                  done.post();
+               }
+            });
+         }
+      });
+   }
+   done.wait();
+
+   double ns = test_chan_ns_since(start);
+
+   printf("%-12s %u senders: %6.1f ns per msg, %.1fM msgs/s\n", "remote task",
+          numSenders, ns / total, total / ns * 1000);
+}
+
+
+void
+test_chan()
+{
+   printf("----- %s -----\n", __func__);
+   follib_init();
+
+   if (follib_get_num_managers() < 2) {
+      printf("%s: needs at least 2 managers\n", __func__);
+   } else {
+      follib_get_manager(0)->addTask([]() {
+         test_chan_bench("one by one", 1);
+         test_chan_bench("batched", kChanBatch);
+         test_chan_remote_task();
+      });
+      follib_run_loop_until_no_ready();
+   }
+
+   follib_quiesce();
+   follib_exit();
+}
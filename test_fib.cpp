@@ -0,0 +1,201 @@
+#include <atomic>
+#include <chrono>
+
+#include <folly/fibers/Baton.h>
+
+#include "follib.h"
+#include "follib_fib.h"
+#include "test_fib.h"
+
+/*
+ * Spawn/join micro-benchmark: every manager spawns and joins no-op fibers,
+ * either one at a time or in batches, and reports how many handles had to
+ * come from the heap. Then manager 0 spawns fibers on every manager with
+ * broadcasts, bulk spawns and a gather. Last, the main thread, off a fiber,
+ * spawns fibers on another manager and blocks to join them.
+ */
+
+static const uint32_t kFibIters = 1000000;
+static const uint32_t kFibBatch = 64;
+
+
+static void *
+test_fib_noop(void *param)
+{
+   return param;
+}
+
+
+static void
+test_fib_worker(uint32_t batch)
+{
+   Fib *fibs[kFibBatch];
+
+   for (uint32_t i = 0; i < kFibIters; i += batch) {
+      for (uint32_t j = 0; j < batch; j++) {
+         fibs[j] = Fiber_Create(test_fib_noop, nullptr);
+      }
+      for (uint32_t j = 0; j < batch; j++) {
+         Fiber_Join(fibs[j], nullptr);
+      }
+   }
+}
+
+
+/*
+ * Run the worker on all the managers and wait for the last one. Runs on a
+ * fiber of manager 0.
+ */
+static void
+test_fib_bench(const char *name,
+               uint32_t    batch)
+{
+   const uint32_t n = follib_get_num_managers();
+   std::atomic<uint32_t> remaining{n};
+   std::atomic<uint64_t> numAllocs{0};
+   folly::fibers::Baton done;
+
+   auto start = std::chrono::steady_clock::now();
+
+   follib_run_in_all_managers([&]() {
+      follib_fib_pool_stats before;
+      follib_fib_pool_stats after;
+
+      Fiber_GetPoolStats(&before);
+      test_fib_worker(batch);
+      Fiber_GetPoolStats(&after);
+
+      numAllocs += after.numAllocs - before.numAllocs;
+      if (remaining.fetch_sub(1) == 1) {
+         done.post();
+      }
+   });
+   done.wait();
+
+   auto elapsed = std::chrono::steady_clock::now() - start;
+   double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+   printf("%-12s %u managers: %6.1f ns per spawn+join, %.1fM/s, "
+          "%lu handles allocated\n", name, n, ns / kFibIters,
+          (double)kFibIters * n / ns * 1000, numAllocs.load());
+}
+
+
+/*
+ * test_fib_broadcast --
+ *
+ *      Start kFibBatch no-op fibers on every manager, with one broadcast per
+ *      fiber or a single bulk one, and wait for them. Then do the same with
+ *      a fan-out/fan-in that sums up what the fibers return. Runs on a fiber
+ *      of manager 0.
+ */
+static void
+test_fib_broadcast()
+{
+   const uint32_t numIters = 1000;
+   const uint32_t n = follib_get_num_managers();
+   follib_mgr_stats before;
+   follib_mgr_stats after;
+   uint64_t sum = 0;
+
+   for (uint32_t bulk = 0; bulk < 2; bulk++) {
+      follib_get_stats(&before);
+      auto start = std::chrono::steady_clock::now();
+
+      for (uint32_t i = 0; i < numIters; i++) {
+         std::atomic<uint32_t> remaining{n * kFibBatch};
+         folly::fibers::Baton done;
+         auto func = [&]() {
+            if (remaining.fetch_sub(1) == 1) {
+               done.post();
+            }
+         };
+
+         if (bulk) {
+            follib_spawn_in_all_managers(kFibBatch, [&](uint32_t) { func(); });
+         } else {
+            for (uint32_t j = 0; j < kFibBatch; j++) {
+               follib_run_in_all_managers(func);
+            }
+         }
+         done.wait();
+      }
+
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+      follib_get_stats(&after);
+      printf("%-12s %u x %u fibers: %8.1f us per round, %.1f remote tasks per round\n",
+             bulk ? "bulk spawn" : "broadcast", n, kFibBatch, ns / numIters / 1000,
+             (double)(after.remoteTasks - before.remoteTasks) / numIters);
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 0; i < numIters; i++) {
+      auto res = follib_gather_all_managers(kFibBatch, [](uint32_t taskIdx) {
+         return (uint64_t)follib_get_mgr_idx() + taskIdx;
+      });
+
+      for (auto v : res) {
+         sum += v;
+      }
+   }
+
+   auto elapsed = std::chrono::steady_clock::now() - start;
+   double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+   printf("%-12s %u x %u fibers: %8.1f us per round (sum %lu)\n", "gather",
+          n, kFibBatch, ns / numIters / 1000, sum);
+}
+
+
+/*
+ * test_fib_remote_join --
+ *
+ *      Join from the main thread fibers running on manager 1: the thread
+ *      sleeps in the baton until each one completes.
+ */
+static void
+test_fib_remote_join()
+{
+   const uint32_t numIters = kFibIters / 10;
+
+   if (follib_get_num_managers() < 2) {
+      return;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 0; i < numIters; i++) {
+      Fiber_Join(Fiber_CreateOn(1, test_fib_noop, nullptr), nullptr);
+   }
+
+   auto elapsed = std::chrono::steady_clock::now() - start;
+   double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+   printf("%-12s thread -> manager 1: %6.1f ns per spawn+join\n", "remote",
+          ns / numIters);
+}
+
+
+void
+test_fib()
+{
+   printf("----- %s -----\n", __func__);
+   follib_init();
+
+   follib_get_manager(0)->addTask([]() {
+      test_fib_bench("one by one", 1);
+      test_fib_bench("batched", kFibBatch);
+      test_fib_broadcast();
+   });
+
+   follib_run_loop_until_no_ready();
+
+   test_fib_remote_join();
+
+   follib_quiesce();
+
+   follib_exit();
+}
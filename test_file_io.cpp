@@ -3,10 +3,14 @@
 #include <stdlib.h>
 
 #include <sstream>
+#include <vector>
 
 #include <folly/Memory.h>
+#include <folly/io/IOBuf.h>
 
 #include "follib.h"
+#include "follib_buf.h"
+#include "follib_hist.h"
 #include "follib_io.h"
 
 #define PAGE_SIZE 4096
@@ -25,6 +29,8 @@ static struct {
    ssize_t     allocSize{64 * 1024};
    size_t      ioSize{4 * 1024};
    uint32_t    numTotalIOs{256};
+   uint32_t    batchSize{16};
+   uint32_t    numFibs{0};      // of each kind, per manager
 } testState;
 
 
@@ -81,7 +87,6 @@ fiber_test_func(int fibIdx)
    for (uint32_t i = 0; i < testState.numTotalIOs; i++) {
       uint32_t j = rand() + i;
       size_t ioSize = testState.ioSize * ((j % 4) + 1);
-      uint8_t *buf;
       uint32_t off;
       bool res;
 
@@ -90,7 +95,7 @@ fiber_test_func(int fibIdx)
          return;
       }
 
-      buf = (uint8_t *)folly::aligned_malloc(ioSize, PAGE_SIZE);
+      follib_buf buf(ioSize);
 
       off = (rand() * 1024) % testState.fileSize;
       if (off + ioSize > testState.fileSize) {
@@ -99,15 +104,110 @@ fiber_test_func(int fibIdx)
 
       bool isRead = (j & 3) != 0;
       if (!isRead) {
-         memset(buf, (uint8_t) j, ioSize);
+         memset(buf.data(), (uint8_t) j, ioSize);
       }
-      res = follib_prw(isRead, testState.fileFd, off, ioSize, buf);
+      res = follib_prw(isRead, testState.fileFd, off, ioSize, buf.data());
       assert(res);
       (void) res;
+   }
+
+   follib_buf_stats stats;
+   follib_buf_get_stats(&stats);
+   printf("thread %u: fiber %d done (buf hits: %lu/%lu max in use: %lu).\n",
+          follib_get_mgr_idx(), fibIdx, stats.numHits, stats.numAllocs,
+          stats.bytesInUseMax);
+}
+
+
+static void
+fiber_test_batch_func(int fibIdx)
+{
+   const uint32_t batchSize = testState.batchSize;
+   const size_t ioSize = testState.ioSize;
+   std::vector<follib_io_op> ops(batchSize);
+   follib_buf buf(batchSize * ioSize);
+
+   assert(testState.fileFd > 0);
+
+   for (uint32_t i = 0; i < testState.numTotalIOs; i += batchSize) {
+      uint32_t res;
+
+      if (follib_need_exit()) {
+         printf("thread %u: fiber %d interrupted.\n", follib_get_mgr_idx(), fibIdx);
+         break;
+      }
+
+      for (uint32_t j = 0; j < batchSize; j++) {
+         ops[j].isRead = true;
+         ops[j].fd     = testState.fileFd;
+         ops[j].offset = ((rand() * 1024) % testState.fileSize) & ~(ioSize - 1);
+         ops[j].length = ioSize;
+         ops[j].buf    = (uint8_t *)buf.data() + j * ioSize;
+      }
+      res = follib_prw_batch(ops.data(), batchSize);
+      assert(res == batchSize);
+      (void) res;
+   }
+
+   follib_io_queue_stats stats;
+   follib_io_get_queue_stats(&stats);
+   printf("thread %u: batch fiber %d done (queued: %lu max: %u).\n",
+          follib_get_mgr_idx(), fibIdx, stats.numQueued, stats.maxQueued);
+}
+
 
-      folly::aligned_free(buf);
+/*
+ * Write a record made of several fragments with a single pwritev and read it
+ * back scattered into an IOBuf chain. Each fiber has a region of its own past
+ * 'fileSize', where the other fibers don't write, so what's read back has to
+ * match.
+ */
+static void
+fiber_test_vec_func(int fibIdx)
+{
+   const uint32_t numFrags = 4;
+   const size_t ioSize = testState.ioSize;
+   const uint32_t region = follib_get_mgr_idx() * testState.numFibs + fibIdx;
+   const uint64_t off = testState.fileSize + region * numFrags * ioSize;
+   follib_buf frags[numFrags];
+   struct iovec iov[numFrags];
+   bool res;
+
+   for (uint32_t i = 0; i < numFrags; i++) {
+      frags[i] = follib_buf(ioSize);
+      memset(frags[i].data(), (uint8_t)(region * numFrags + i + 1), ioSize);
+      iov[i].iov_base = frags[i].data();
+      iov[i].iov_len  = ioSize;
+   }
+   res = follib_pwritev(testState.fileFd, off, iov, numFrags);
+   assert(res);
+
+   follib_buf readBuf(numFrags * ioSize);
+   auto chain = folly::IOBuf::wrapBuffer(readBuf.data(), ioSize);
+   for (uint32_t i = 1; i < numFrags; i++) {
+      chain->appendChain(folly::IOBuf::wrapBuffer((uint8_t *)readBuf.data() + i * ioSize,
+                                                  ioSize));
    }
-   printf("thread %u: fiber %d done.\n", follib_get_mgr_idx(), fibIdx);
+   folly::IOBuf *b = chain.get();
+   do {
+      b->clear();
+      b = b->next();
+   } while (b != chain.get());
+
+   res = follib_preadv(testState.fileFd, off, chain.get());
+   assert(res);
+   assert(chain->computeChainDataLength() == numFrags * ioSize);
+   (void) res;
+
+   for (uint32_t i = 0; i < numFrags; i++) {
+      if (memcmp((uint8_t *)readBuf.data() + i * ioSize, frags[i].data(), ioSize) != 0) {
+         printf("thread %u: vec fiber %d: fragment %u read back wrong.\n",
+                follib_get_mgr_idx(), fibIdx, i);
+         exit(1);
+      }
+   }
+
+   printf("thread %u: vec fiber %d done.\n", follib_get_mgr_idx(), fibIdx);
 }
 
 
@@ -115,9 +215,42 @@ static void
 test_run_func_in_each_manager(uint32_t numFibs)
 {
    printf("launching %u fibers.\n", numFibs);
+   testState.numFibs = numFibs;
+
+   follib_spawn_in_all_managers(3 * numFibs, [](uint32_t i) {
+      switch (i % 3) {
+      case 0:
+         fiber_test_func(i / 3);
+         break;
+      case 1:
+         fiber_test_batch_func(i / 3);
+         break;
+      default:
+         fiber_test_vec_func(i / 3);
+         break;
+      }
+   });
+}
+
 
-   for (uint32_t i = 0; i < numFibs; i++) {
-      follib_run_in_all_managers([i]() { fiber_test_func(i); });
+/*
+ * test_print_queue_stats --
+ *
+ *      Collect the admission queue counters of every manager.
+ */
+static void
+test_print_queue_stats()
+{
+   auto stats = follib_gather_all_managers(1, [](uint32_t) {
+      follib_io_queue_stats s;
+
+      follib_io_get_queue_stats(&s);
+      return s;
+   });
+
+   for (uint32_t i = 0; i < stats.size(); i++) {
+      printf("manager %u: queued: %lu throttled: %lu max queued: %u\n",
+             i, stats[i].numQueued, stats[i].numThrottled, stats[i].maxQueued);
    }
 }
 
@@ -130,12 +263,41 @@ test_file_io()
 
    test_prepare_file();
 
+   /*
+    * This thread is manager 0's, so the latency calls go through one of its
+    * fibers.
+    */
+   follib_run_on_manager_sync(0, []() {
+      follib_io_track_fd(testState.fileFd);
+   });
+
    test_run_func_in_each_manager(10);
 
    follib_run_loop_until_no_ready();
 
+   follib_hist hist;
+   follib_run_on_manager_sync(0, [&hist]() {
+      follib_io_get_latency(true, FOLLIB_IO_LAT_DEVICE, -1, &hist);
+      follib_hist_print(&hist, "read device ns");
+      follib_io_get_latency(true, FOLLIB_IO_LAT_WAKEUP, -1, &hist);
+      follib_hist_print(&hist, "read wakeup ns");
+      follib_io_get_latency(false, FOLLIB_IO_LAT_DEVICE, testState.fileFd,
+                            &hist);
+      follib_hist_print(&hist, "file write device ns");
+      follib_io_forget_fd(testState.fileFd);
+   });
+
+   test_print_queue_stats();
+
    follib_quiesce();
 
+   follib_mgr_stats stats;
+   follib_get_stats(&stats);
+   printf("%s: loops: %lu reads: %lu (%lu bytes) writes: %lu (%lu bytes) "
+          "remote tasks: %lu\n", __func__, stats.loopIterations,
+          stats.numReads, stats.bytesRead, stats.numWrites,
+          stats.bytesWritten, stats.remoteTasks);
+
    test_close_file();
 
    follib_exit();
@@ -1,7 +1,8 @@
 #include <stdio.h>
 #include <unistd.h>
 
-#include <map>
+#include <chrono>
+#include <vector>
 
 #include <folly/fibers/Fiber.h>
 #include <folly/fibers/FiberManager.h>
@@ -11,93 +12,24 @@
 #include <folly/experimental/io/AsyncIO.h>
 
 #include "follib.h"
+#include "follib_conn_table.h"
+#include "follib_fib.h"
+#include "follib_net.h"
 #include "test_net_server.h"
 
 using namespace folly;
 
-typedef void* (FiberRunFunc)(void*);
-
-class Fib {
-public:
-   void Wait() {
-      printf("-- %s:%u\n", __func__, __LINE__);
-
-      if (folly::fibers::onFiber()) {
-         baton_.wait();
-      } else {
-         while (!baton_.try_wait()) {
-            follib_run_loop_once(); // XXX
-         }
-      }
-   }
-   void Complete(void *res) {
-      printf("-- %s:%u\n", __func__, __LINE__);
-      result_ = res;
-      baton_.post();
-   }
-   void *GetResult() { return result_; }
-
-private:
-   folly::fibers::Baton baton_;
-   void                *result_{nullptr};
-};
-
-
-class TestNetReadCB : public folly::AsyncReader::ReadCallback {
-public:
-   TestNetReadCB(void *buf, uint64_t len) {
-      ioBuf_ = IOBuf::takeOwnership(buf, len, (uint64_t)0,
-                                    [](void *buf, void *user) { /* wheee */ });
-      DCHECK_EQ(ioBuf_->writableData(), buf);
-      DCHECK_EQ(ioBuf_->tailroom(), len);
-   }
-   void getReadBuffer(void  **bufPtr,
-                      size_t *lenPtr) override {
-      *bufPtr = ioBuf_->writableData();
-      *lenPtr = ioBuf_->tailroom();
-      FLOG(1, "-- %s:%u buf=0x%p len=%zu\n",
-           __func__, __LINE__, *bufPtr, *lenPtr);
-   }
-   void readDataAvailable(size_t readLen) noexcept override {
-      ioBuf_->append(readLen);
-      FLOG(1, " tailroom / length: %zd / %zd\n",
-           ioBuf_->tailroom(), ioBuf_->length());
-      if (ioBuf_->tailroom() == 0) {
-         Signal();
-      }
-   }
-   void readEOF() noexcept override {
-//      printf("-- %s\n", __func__);
-      eof_ = true;
-      Signal();
-   }
-   void readErr(const AsyncSocketException& ex) noexcept override {
-      FLOG(3, "-- %s: %s\n", __func__, ex.what());
-//      exc_ = ex;
-      Signal();
-      follib_stop_test();
-   }
-
-   void ReadAllData() {
-      baton_.wait();
-      baton_.reset();
-   }
-   size_t ReadLen() const { return ioBuf_->length(); }
-   bool   IsEOF() const { return eof_; }
-   void   Signal() { baton_.post(); }
-
-   bool                   closed_{false};
-
-private:
-   std::unique_ptr<IOBuf> ioBuf_;
-   folly::fibers::Baton   baton_;
-   bool                   eof_{false};
-};
+/*
+ * Have every manager listen on the server port and serve the connections it
+ * accepts, instead of a single accept loop.
+ */
+static const bool acceptOnAllManagers = true;
 
+class TestNetServer;
 
 class TestNetConn {
 public:
-   TestNetConn(int fd) : fd_(fd) {}
+   TestNetConn(TestNetServer *server, int fd) : server_(server), fd_(fd) {}
    ~TestNetConn() { }
 
    void Start();
@@ -105,31 +37,49 @@ public:
    int  GetFd() const { return fd_; }
    void Close();
    void DoWork();
+   void Done();
 
 private:
+   FiberSocketReader             reader_;
+   FiberSocketWriter             writer_;
    std::shared_ptr<AsyncSocket>  sock_;
+   TestNetServer                *server_;
    int                           fd_{-1};
+   bool                          closed_{false};
    Fib                          *fib_{nullptr};
+   uint64_t                      numReads_{0};
+   uint64_t                      numBytes_{0};
 };
 
 
 
+/*
+ * A listening socket and its accept loop. The connections it accepts are
+ * served on the same manager.
+ */
+struct TestNetAcceptor {
+   Fib                                *acceptFib{nullptr};
+   std::shared_ptr<AsyncServerSocket>  acceptSock;
+};
+
+
 class TestNetServer {
 public:
    TestNetServer();
    ~TestNetServer();
    int StartAccept(const char *addrStr, uint16_t port, uint32_t threadId);
+   int StartAcceptAll(const char *addrStr, uint16_t port);
    void Exit();
    void AcceptLoop();
+   std::shared_ptr<TestNetConn> RemoveConn(int fd) { return conns_.remove(fd); }
 
 private:
    int InitOnEventBase(std::string addr, uint16_t port);
+   int InitOnManager(uint32_t thId, const char *addrStr, uint16_t port);
    void ExitOnEventBase();
 
-   Fib                                        *acceptFib_{nullptr};
-   std::shared_ptr<AsyncServerSocket>          acceptSock_;
-   std::map<int, std::shared_ptr<TestNetConn>> connMap_;
-   folly::SharedMutex                          mutex_;
+   std::vector<TestNetAcceptor>                acceptors_;  // by manager
+   follib_conn_table<TestNetConn>              conns_;      // owns them
 };
 
 
@@ -138,21 +88,21 @@ class TestNetAcceptCB : public AsyncServerSocket::AcceptCallback {
 public:
    void connectionAccepted(int fd,
                            const SocketAddress& addr) noexcept override {
-      FLOG(0, "-- %s:%u fd=%d\n", __func__, __LINE__, fd);
+      FLOGS(FOLLIB_LOG_NET, 0, "-- %s:%u fd=%d\n", __func__, __LINE__, fd);
       fd_ = fd;
       baton_.post();
    }
    void acceptError(const std::exception& ex) noexcept override {
-      FLOG(0, "-- %s:%u '%s'\n", __func__, __LINE__, ex.what());
+      FLOGS(FOLLIB_LOG_NET, 0, "-- %s:%u '%s'\n", __func__, __LINE__, ex.what());
    }
    void acceptStarted() noexcept override {
       refCount_++;
-      FLOG(0, "-- %s:%u refCount=%d\n", __func__, __LINE__, refCount_);
+      FLOGS(FOLLIB_LOG_NET, 0, "-- %s:%u refCount=%d\n", __func__, __LINE__, refCount_);
    }
    void acceptStopped() noexcept override {
       baton_.post();
       refCount_--;
-      FLOG(0, "-- %s:%u refCount=%d\n", __func__, __LINE__, refCount_);
+      FLOGS(FOLLIB_LOG_NET, 0, "-- %s:%u refCount=%d\n", __func__, __LINE__, refCount_);
       if (refCount_ == 0) {
          delete this;
       }
@@ -175,50 +125,11 @@ public:
    ssize_t Read(void *buf, size_t bufLen);
 
 private:
-   TestNetReadCB                readCB_;
+   FiberSocketReader            reader_;
    std::shared_ptr<AsyncSocket> sock_;
 };
 
 
-Fib *
-Fiber_Create(FiberRunFunc *func,
-             void         *param)
-{
-   auto mgr = follib_get_manager();
-   Fib *fib;
-
-   fib = new(std::nothrow) Fib();
-
-   FLOG(1, "-- %s:%u func=%p param=%p\n", __func__, __LINE__,
-        (void *)func, param);
-
-   auto fn = [fib, func, param]() {
-      void *res = func(param);
-      fib->Complete(res);
-   };
-
-   mgr->addTask(std::move(fn));
-
-   return fib;
-}
-
-
-int
-Fiber_Join(Fib   *fib,
-           void **result)
-{
-   printf("-- %s:%u\n", __func__, __LINE__);
-   fib->Wait();
-   printf("-- %s:%u\n", __func__, __LINE__);
-
-   if (result) {
-      *result = fib->GetResult();
-   }
-   delete fib;
-   return 0;
-}
-
-
 int
 Fiber_Accept(std::shared_ptr<AsyncServerSocket> sock)
 {
@@ -259,71 +170,55 @@ Fiber_Close(std::shared_ptr<AsyncServerSocket> sock)
 }
 
 
-ssize_t
-Follib_Read(std::shared_ptr<AsyncSocket> sock,
-            void                        *buf,
-            size_t                       len)
-{
-   auto readCB = new TestNetReadCB(buf, len);
-   ssize_t res;
-
-   sock->setReadCB(readCB);
-
-   readCB->ReadAllData();
-
-   sock->setReadCB(nullptr);
-
-   res = -1;
-   if (!readCB->IsEOF() && !readCB->closed_) {
-      res = readCB->ReadLen();
-   }
-
-   delete readCB;
-
-   FLOG(2, "Just read %zd bytes.\n", res);
-
-   return res;
-}
-
-
 void
 TestNetConn::DoWork()
 {
+   auto start = std::chrono::steady_clock::now();
+
+   std::string line;   // reused, so its buffer is only grown once
+
    printf("-- %s:%u conn work starting\n", __func__, __LINE__);
 
    while (true) {
-      char buf[33];
-      ssize_t res;
-
-      buf[32] = '\0';
-      res = Follib_Read(sock_, buf, sizeof buf - 1);
-      if (res < 0) {
+      if (!reader_.ReadLine(&line)) {
          printf("-- %s:%u\n", __func__, __LINE__);
+         if (reader_.Failed()) {
+            follib_stop_test();
+         }
+         break;
+      }
+      numReads_++;
+      numBytes_ += line.size() + 1;
+
+      FLOGS(FOLLIB_LOG_NET, 1, "Read %zu bytes.\n", line.size());
+      printf("-- '%s'\n", line.c_str());
+
+      struct iovec iov[2];
+      iov[0].iov_base = &line[0];
+      iov[0].iov_len  = line.size();
+      iov[1].iov_base = const_cast<char *>("\n");
+      iov[1].iov_len  = 1;
+      if (!Follib_Writev(&writer_, iov, 2)) {
          break;
       }
-
-      FLOG(1, "Read %zd bytes.\n", res);
-      std::string s(&buf[0]);
-      const auto isEOLFunc = [](char x){ return x == '\n' || x == '\r'; };
-      s.erase(std::remove_if(s.begin(), s.end(), isEOLFunc), s.end());
-
-      printf("-- '%s'\n", s.c_str());
    }
+   writer_.Flush();
 
-   printf("-- %s:%u conn work done\n", __func__, __LINE__);
+   std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+   printf("-- %s:%u conn work done: %lu reads, %lu bytes in %.3fs "
+          "(%.0f reads/s, %.0f bytes/s)\n", __func__, __LINE__,
+          numReads_, numBytes_, secs.count(),
+          numReads_ / secs.count(), numBytes_ / secs.count());
 }
 
 
 void
 TestNetConn::Close()
 {
-   if (auto readCB = sock_->getReadCallback()) {
-      TestNetReadCB *cb = dynamic_cast<TestNetReadCB *>(readCB);
-
-      printf("%s: signalling end of read.\n", __func__);
-      cb->closed_ = true;
-      cb->Signal();
-   }
+   printf("%s: signalling end of read.\n", __func__);
+   closed_ = true;
+   reader_.Close();
+   writer_.Detach();
 
    sock_.reset();
 }
@@ -335,6 +230,7 @@ TestNetConnReadWrapper(void *clientData)
    TestNetConn *conn = static_cast<TestNetConn *>(clientData);
 
    conn->DoWork();
+   conn->Done();
 
    return nullptr;
 }
@@ -350,13 +246,37 @@ TestNetConn::Start()
    sock_ = AsyncSocket::newSocket(follib_get_evb(), fd_);
 
    /*
-    * We only want get read callbacks to read a certain number of bytes. Once
-    * we've read all the data needed we unregister those callbacks. If
-    * maxReadsPerEvent is >1, we may get getReadBuffer callbacks even though
-    * we're done reading. We wouldn't know what to do with the data just read.
+    * The reader stays installed for the life of the connection and reads
+    * ahead as much as the socket has, so pipelined requests are parsed out
+    * of its buffer.
+    */
+   reader_.Attach(sock_.get());
+
+   /*
+    * Replies to pipelined requests handled in the same loop iteration go out
+    * with a single write.
     */
-   sock_->setMaxReadsPerEvent(1);
+   writer_.Attach(sock_.get());
+   writer_.SetCork(true);
+}
+
 
+/*
+ * TestNetConn::Done --
+ *
+ *      The peer went away: take the connection out of the server and have
+ *      another fiber join this one and drop it. Nothing to do when stopped.
+ */
+void
+TestNetConn::Done()
+{
+   if (closed_) {
+      return;
+   }
+   auto self = server_->RemoveConn(fd_);
+   if (self) {
+      follib_get_manager()->addTask([self]() { self->Stop(); });
+   }
 }
 
 
@@ -372,20 +292,32 @@ TestNetConn::Stop()
 }
 
 
+/*
+ * TestNetServer::AcceptLoop --
+ *
+ *      Accept connections on the calling manager's socket and serve them on
+ *      this manager.
+ */
 void
 TestNetServer::AcceptLoop()
 {
+   auto& acceptor = acceptors_[follib_get_mgr_idx()];
+
    printf("-- %s:%u -- accept loop started\n", __func__, __LINE__);
    while (true) {
       printf("calling accept..\n");
-      int fd = Fiber_Accept(acceptSock_);
+      int fd = Fiber_Accept(acceptor.acceptSock);
       printf("accept returns fd=%d\n", fd);
       if (fd < 0) {
          break;
       }
-      auto conn = std::make_shared<TestNetConn>(fd);
+      auto conn = std::make_shared<TestNetConn>(this, fd);
 
-      connMap_[fd] = conn;
+      if (!conns_.insert(fd, conn)) {
+         printf("too many connections, dropping fd=%d\n", fd);
+         close(fd);
+         continue;
+      }
       conn->Start();
    }
 
@@ -414,16 +346,39 @@ TestNetServer::InitOnEventBase(std::string addrStr,
 {
    auto addr = SocketAddress(addrStr, port);
    auto evb = follib_get_evb();
+   auto& acceptor = acceptors_[follib_get_mgr_idx()];
+
+   acceptor.acceptSock = AsyncServerSocket::newSocket(evb);
+
+   try {
+      acceptor.acceptSock->setReusePortEnabled(true);
+      acceptor.acceptSock->bind(addr);
+      acceptor.acceptSock->listen(10);
+   } catch (const std::exception& ex) {
+      printf("%u: failed to listen on %s:%u: %s\n", follib_get_mgr_idx(),
+             addrStr.c_str(), port, ex.what());
+      acceptor.acceptSock.reset();
+      return EINVAL;
+   }
 
-   acceptSock_ = AsyncServerSocket::newSocket(evb);
+   acceptor.acceptFib = Fiber_Create(AcceptWrapperFunc, this);
 
-   acceptSock_->setReusePortEnabled(true);
-   acceptSock_->bind(addr);
-   acceptSock_->listen(10);
+   return 0;
+}
 
-   acceptFib_ = Fiber_Create(AcceptWrapperFunc, this);
 
-   return 0;
+int
+TestNetServer::InitOnManager(uint32_t    thId,
+                             const char *addrStr,
+                             uint16_t    port)
+{
+   int err = 0;
+
+   follib_run_on_manager_sync(thId, [&]() {
+      err = InitOnEventBase(addrStr, port);
+   });
+
+   return err;
 }
 
 
@@ -432,20 +387,41 @@ TestNetServer::StartAccept(const char *addrStr,
                            uint16_t    port,
                            uint32_t    thId)
 {
-   auto evb = follib_get_evb(thId);
-   int err = 0;
-
    printf("%s: init server at %s:%u\n", __func__, addrStr, port);
 
-   folly::fibers::Baton baton;
-   evb->runInEventBaseThread([&]() {
-      err = InitOnEventBase(addrStr, port);
-      baton.post();
-   });
+   acceptors_.resize(follib_get_num_managers());
+
+   return InitOnManager(thId, addrStr, port);
+}
 
-   baton.wait();
 
-   return err;
+/*
+ * TestNetServer::StartAcceptAll --
+ *
+ *      Run an accept loop on every manager, each on its own SO_REUSEPORT
+ *      socket bound to the same port. The kernel spreads the incoming
+ *      connections over them and each is served where it was accepted.
+ */
+int
+TestNetServer::StartAcceptAll(const char *addrStr,
+                              uint16_t    port)
+{
+   const uint32_t n = follib_get_num_managers();
+
+   printf("%s: init server at %s:%u on %u threads\n", __func__, addrStr,
+          port, n);
+
+   acceptors_.resize(n);
+
+   for (uint32_t i = 0; i < n; i++) {
+      int err = InitOnManager(i, addrStr, port);
+
+      if (err != 0) {
+         Exit();
+         return err;
+      }
+   }
+   return 0;
 }
 
 TestNetServer::TestNetServer()
@@ -462,19 +438,21 @@ TestNetServer::~TestNetServer()
 void
 TestNetServer::ExitOnEventBase()
 {
-   Fiber_Close(acceptSock_);
-   if (acceptFib_) {
-      Fiber_Join(acceptFib_, nullptr);
+   auto& acceptor = acceptors_[follib_get_mgr_idx()];
+
+   Fiber_Close(acceptor.acceptSock);
+   if (acceptor.acceptFib) {
+      Fiber_Join(acceptor.acceptFib, nullptr);
+      acceptor.acceptFib = nullptr;
    }
 
-   for (auto p : connMap_) {
-      auto conn = p.second;
-      FLOG(0, "Closing conn for fd=%d\n", conn->GetFd());
+   conns_.drain_local([](std::shared_ptr<TestNetConn> conn) {
+      FLOGS(FOLLIB_LOG_NET, 0, "Closing conn for fd=%d\n", conn->GetFd());
 
       conn->Stop();
-   }
+   });
 
-   acceptSock_.reset();
+   acceptor.acceptSock.reset();
 }
 
 
@@ -483,15 +461,11 @@ TestNetServer::Exit()
 {
    printf("stopping accept server\n");
 
-   auto evb = acceptSock_->getEventBase();
-   folly::fibers::Baton baton;
-
-   evb->runInEventBaseThread([&]() {
-      ExitOnEventBase();
-      baton.post();
-   });
-
-   baton.wait();
+   for (uint32_t i = 0; i < acceptors_.size(); i++) {
+      if (acceptors_[i].acceptSock) {
+         follib_run_on_manager_sync(i, [this]() { ExitOnEventBase(); });
+      }
+   }
 
    printf("server accept stopped\n");
 }
@@ -507,7 +481,9 @@ test_net_server()
    {
       auto server = std::make_shared<TestNetServer>();
 
-      auto res = server->StartAccept("127.0.0.1", 1666, 1);
+      auto res = acceptOnAllManagers ?
+                 server->StartAcceptAll("127.0.0.1", 1666) :
+                 server->StartAccept("127.0.0.1", 1666, 1);
       if (res != 0) {
          goto done;
       }
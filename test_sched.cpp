@@ -0,0 +1,179 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <folly/fibers/Baton.h>
+
+#include "follib.h"
+#include "follib_sched.h"
+#include "test_sched.h"
+
+/*
+ * Connection placement under each policy, then an unbalanced load: manager 0
+ * spawns every task, each one burning cpu without yielding, so the other
+ * managers only get any of them by stealing.
+ */
+
+static const uint32_t kSchedNumTasks = 256;
+static const uint32_t kSchedTaskUs   = 500;
+static const uint32_t kPlaceBurst    = 16;    // connections per manager
+
+
+static void
+test_sched_spin(uint32_t us)
+{
+   auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+
+   while (std::chrono::steady_clock::now() < end) {
+   }
+}
+
+
+/*
+ * test_sched_steal --
+ *
+ *      Runs on a fiber of manager 0. Checks that every task ran exactly once
+ *      and that some of them ran elsewhere.
+ */
+static void
+test_sched_steal()
+{
+   const uint32_t n = follib_get_num_managers();
+   std::unique_ptr<std::atomic<uint32_t>[]> runs(new std::atomic<uint32_t>[kSchedNumTasks]);
+   std::atomic<uint32_t> remaining{kSchedNumTasks};
+   folly::fibers::Baton done;
+   uint64_t numStolen = 0;
+   uint64_t numRun = 0;
+   bool ok = true;
+
+   for (uint32_t i = 0; i < kSchedNumTasks; i++) {
+      runs[i] = 0;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 0; i < kSchedNumTasks; i++) {
+      follib_spawn_migratable([&, i]() {
+         test_sched_spin(kSchedTaskUs);
+         runs[i].fetch_add(1);
+         if (remaining.fetch_sub(1) == 1) {
+            done.post();
+         }
+      });
+   }
+   done.wait();
+
+   std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+   for (uint32_t i = 0; i < kSchedNumTasks; i++) {
+      if (runs[i] != 1) {
+         printf("%s: task %u ran %u times\n", __func__, i, runs[i].load());
+         ok = false;
+      }
+   }
+   for (uint32_t i = 0; i < n; i++) {
+      follib_sched_stats stats;
+
+      follib_sched_get_stats(i, &stats);
+      printf("manager %u: spawned: %lu run: %lu stolen: %lu thief wakeups: %lu\n",
+             i, stats.numSpawned, stats.numRun, stats.numStolen,
+             stats.numThiefWakeups);
+      numStolen += stats.numStolen;
+      numRun += stats.numRun;
+   }
+   if (numStolen == 0 || numRun != kSchedNumTasks) {
+      printf("%s: %lu tasks stolen, %lu run\n", __func__, numStolen, numRun);
+      ok = false;
+   }
+
+   printf("%s: %u tasks of %u us in %.3fs (%.3fs on one manager): %s\n",
+          __func__, kSchedNumTasks, kSchedTaskUs, secs.count(),
+          kSchedNumTasks * kSchedTaskUs / 1e6, ok ? "ok" : "FAILED");
+   if (!ok) {
+      exit(1);
+   }
+}
+
+
+/*
+ * test_sched_place --
+ *
+ *      Place a burst of connections under 'policy', as an acceptor would
+ *      before any of them got to run, and check how they spread. The
+ *      deterministic policies have to be even; the load-based ones may lean
+ *      on whatever the managers were doing but no manager may be skipped nor
+ *      get twice its share.
+ */
+static bool
+test_sched_place(const char          *name,
+                 follib_place_policy  policy)
+{
+   const uint32_t n = follib_get_num_managers();
+   const uint32_t numConns = n * kPlaceBurst;
+   follib_placer *placer = follib_placer_create(policy);
+   std::vector<uint32_t> placed;
+   uint32_t minConns = UINT32_MAX;
+   uint32_t maxConns = 0;
+   bool ok;
+
+   for (uint32_t i = 0; i < numConns; i++) {
+      placed.push_back(follib_place(placer));
+   }
+   for (uint32_t i = 0; i < n; i++) {
+      minConns = std::min(minConns, follib_place_num_conns(placer, i));
+      maxConns = std::max(maxConns, follib_place_num_conns(placer, i));
+   }
+   if (policy == FOLLIB_PLACE_ROUND_ROBIN || policy == FOLLIB_PLACE_LEAST_CONNS) {
+      ok = minConns == kPlaceBurst && maxConns == kPlaceBurst;
+   } else {
+      ok = minConns > 0 && maxConns <= 2 * kPlaceBurst;
+   }
+
+   for (uint32_t idx : placed) {
+      follib_place_release(placer, idx);
+   }
+   for (uint32_t i = 0; i < n; i++) {
+      ok = ok && follib_place_num_conns(placer, i) == 0;
+   }
+   follib_placer_destroy(placer);
+
+   printf("%s: %-12s %u conns on %u managers: min %u max %u: %s\n", __func__,
+          name, numConns, n, minConns, maxConns, ok ? "ok" : "FAILED");
+   return ok;
+}
+
+
+void
+test_sched()
+{
+   follib_options opts;
+
+   printf("----- %s -----\n", __func__);
+   opts.workStealing = true;
+   follib_init(&opts);
+
+   if (follib_get_num_managers() < 2) {
+      printf("%s: needs at least 2 managers\n", __func__);
+   } else {
+      follib_get_manager(0)->addTask([]() {
+         bool ok = true;
+
+         ok &= test_sched_place("round robin", FOLLIB_PLACE_ROUND_ROBIN);
+         ok &= test_sched_place("least conns", FOLLIB_PLACE_LEAST_CONNS);
+         ok &= test_sched_place("least loaded", FOLLIB_PLACE_LEAST_LOADED);
+         ok &= test_sched_place("two choices", FOLLIB_PLACE_TWO_CHOICES);
+         if (!ok) {
+            exit(1);
+         }
+         test_sched_steal();
+      });
+      follib_run_loop_until_no_ready();
+   }
+
+   follib_quiesce();
+   follib_exit();
+}
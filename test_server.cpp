@@ -1,11 +1,12 @@
 #include <stdio.h>
-#include <map>
+#include <vector>
 
 #include <folly/io/async/AsyncSocket.h>
 #include <folly/io/async/AsyncServerSocket.h>
-#include <folly/SharedMutex.h>
 
 #include "follib.h"
+#include "follib_conn_table.h"
+#include "follib_sched.h"
 
 #include "test_server.h"
 
@@ -13,6 +14,18 @@ using namespace folly;
 
 static const uint64_t readLen = 64;
 
+/*
+ * Have every manager listen on the server port and handle the connections it
+ * accepts, instead of one manager accepting for all of them.
+ */
+static const bool acceptOnAllManagers = true;
+
+/*
+ * Otherwise, how the accepting manager spreads the connections over the
+ * others.
+ */
+static const follib_place_policy connPlacement = FOLLIB_PLACE_TWO_CHOICES;
+
 class TestConn;
 
 /*
@@ -26,7 +39,9 @@ public:
    ~TestServer();
    std::shared_ptr<TestServer> GetSharedPtr() { return shared_from_this(); }
    int  StartAccept(const char *addrStr, uint16_t port, uint32_t threadId);
+   int  StartAcceptAll(const char *addrStr, uint16_t port);
    void Exit();
+   bool RegisterConn(int fd, std::shared_ptr<TestConn> conn);
    void RemoveConn(std::shared_ptr<TestConn> conn);
 
    void connectionAccepted(int fd, const SocketAddress& addr) noexcept override {
@@ -38,32 +53,30 @@ public:
       follib_stop_test();
    }
    void acceptStarted() noexcept override {
-      printf("now accepting incoming connections on fd=%d\n",
-             acceptSock_->getSocket());
+      printf("%u: now accepting incoming connections on fd=%d\n",
+             follib_get_mgr_idx(),
+             acceptSocks_[follib_get_mgr_idx()]->getSocket());
    }
    void acceptStopped() noexcept override {
       printf("stopped accepting connections.\n");
       // can't use acceptSock_ here. It may already be gone.
    }
 
-   uint32_t GetConnThreadId() {
-      auto res = thId_;
-      assert(thId_ < follib_get_num_managers());
-      thId_ = (thId_ + 1) % follib_get_num_managers();
-      return res;
-   }
-
 private:
    void StopAccept();
    void AddConn(int fd);
    int  InitOnEventBase(const std::string& addrStr, uint16_t port);
+   int  InitOnManager(uint32_t thId, const std::string& addrStr, uint16_t port);
    void ExitOnEventBase();
-   void StopConn(std::shared_ptr<TestConn> conn);
 
-   std::shared_ptr<AsyncServerSocket>         acceptSock_;
-   std::map<int, std::shared_ptr<TestConn>>   connMap_;
-   folly::SharedMutex                         mutex_;
-   uint32_t                                   thId_{2};
+   /*
+    * One listening socket per manager, only touched by its manager once
+    * set up. A single one is used unless accepting on all managers.
+    */
+   std::vector<std::shared_ptr<AsyncServerSocket>> acceptSocks_;
+   bool                                             acceptLocal_{false};
+   follib_conn_table<TestConn>                      conns_;   // owns them
+   follib_placer                                   *placer_{nullptr};
 };
 
 
@@ -71,12 +84,14 @@ class TestConn : public folly::AsyncReader::ReadCallback,
                  public enable_shared_from_this<TestConn> {
 public:
    static std::shared_ptr<TestConn> newConn(std::shared_ptr<TestServer> server,
-                                            int fd);
+                                            int fd, uint32_t thId);
 
    std::shared_ptr<TestConn> GetSharedPtr() { return shared_from_this(); }
-   TestConn(std::shared_ptr<TestServer> srv) : server_(srv) { }
+   TestConn(std::shared_ptr<TestServer> srv, uint32_t thId)
+      : server_(srv), thId_(thId) { }
    ~TestConn();
    int GetFd() const { return sock_->getFd(); }
+   uint32_t GetThreadId() const { return thId_; }
    folly::EventBase *GetEventBase() const { return sock_->getEventBase(); }
 
    void StopWork() {
@@ -133,6 +148,7 @@ private:
    std::unique_ptr<IOBuf>       readBuf_;
    std::unique_ptr<IOBuf>       todoBuf_;
    folly::fibers::Baton         baton_;
+   uint32_t                     thId_;
    bool                         destroyed_{false};
    bool                         exit_{false};
 };
@@ -149,27 +165,27 @@ TestConn::~TestConn()
 }
 
 
+/*
+ * TestConn::newConn --
+ *
+ *      Create a connection for 'fd' hosted by manager 'thId'. Set up right
+ *      away when that's the calling manager, otherwise on the manager's event
+ *      base.
+ */
 std::shared_ptr<TestConn>
 TestConn::newConn(std::shared_ptr<TestServer> server,
-                  int fd)
+                  int fd,
+                  uint32_t thId)
 {
-   /*
-    * This is where/how we decide what manager is going to host that
-    * new connection.
-    */
-   auto thId = server->GetConnThreadId();
    auto evb  = follib_get_evb(thId);
-   auto conn = std::make_shared<TestConn>(server);
-
-   std::weak_ptr<TestConn> connWeak = conn;
+   auto conn = std::make_shared<TestConn>(server, thId);
 
-   auto func = [connWeak, fd]() {
-      if (auto c = connWeak.lock()) {
-         c->InitOnEventBase(fd);
-      }
-   };
+   if (thId == follib_get_mgr_idx()) {
+      conn->InitOnEventBase(fd);
+      return conn;
+   }
 
-   evb->runInEventBaseThread(func);
+   evb->runInEventBaseThread([conn, fd]() { conn->InitOnEventBase(fd); });
    return conn;
 }
 
@@ -209,6 +225,13 @@ TestConn::InitOnEventBase(int fd)
 {
    printf("%u: initing  connection w/ fd=%d\n", follib_get_mgr_idx(), fd);
    sock_ = AsyncSocket::newSocket(follib_get_evb(), fd);
+
+   if (!server_->RegisterConn(fd, GetSharedPtr())) {
+      printf("%u: too many connections, dropping fd=%d\n",
+             follib_get_mgr_idx(), fd);
+      exit_ = true;
+      return;
+   }
    sock_->setReadCB(this);
 
    std::weak_ptr<TestConn> connWeak = GetSharedPtr();
@@ -224,49 +247,72 @@ TestConn::InitOnEventBase(int fd)
 
 TestServer::~TestServer()
 {
-   assert(!acceptSock_);
-   assert(connMap_.empty());
+   for (auto& acceptSock : acceptSocks_) {
+      assert(!acceptSock);
+   }
+   assert(conns_.size() == 0);
+   if (placer_) {
+      follib_placer_destroy(placer_);
+   }
 }
 
 
-void
-TestServer::StopConn(std::shared_ptr<TestConn> conn)
+/*
+ * TestServer::RegisterConn --
+ *
+ *      Runs on the manager hosting the connection, which owns its entry in
+ *      the connection table from now on.
+ */
+bool
+TestServer::RegisterConn(int                       fd,
+                         std::shared_ptr<TestConn> conn)
 {
-   auto evb = conn->GetEventBase();
-
-   std::weak_ptr<TestConn> connWeak = conn;
-
-   evb->runInEventBaseThread([connWeak]() {
-      if (auto c = connWeak.lock()) {
-         c->StopWork();
-         c.reset();
-      }
-   });
+   if (conns_.insert(fd, conn)) {
+      return true;
+   }
+   if (placer_) {
+      follib_place_release(placer_, conn->GetThreadId());
+   }
+   return false;
 }
 
 
+/*
+ * TestServer::RemoveConn --
+ *
+ *      Runs on the manager hosting the connection. Nothing to do if Exit()
+ *      got to it first.
+ */
 void
 TestServer::RemoveConn(std::shared_ptr<TestConn> conn)
 {
    printf("-- %s:%u\n", __func__, __LINE__);
 
-   mutex_.lock();
-   connMap_.erase(conn->GetFd());
-   mutex_.unlock();
-
-   StopConn(conn);
+   auto c = conns_.remove(conn->GetFd());
+   if (!c) {
+      return;
+   }
+   if (placer_) {
+      follib_place_release(placer_, c->GetThreadId());
+   }
+   c->StopWork();
 }
 
 
+/*
+ * TestServer::AddConn --
+ *
+ *      This is where/how we decide what manager is going to host a new
+ *      connection. When all managers accept, the kernel already spread the
+ *      connections over the listening sockets, so keep it where it is.
+ */
 void
 TestServer::AddConn(int fd)
 {
    auto thisShared = GetSharedPtr();
-   auto conn = TestConn::newConn(thisShared, fd);
+   auto thId = acceptLocal_ ? follib_get_mgr_idx() : follib_place(placer_);
 
-   mutex_.lock();
-   connMap_[fd] = conn;
-   mutex_.unlock();
+   TestConn::newConn(thisShared, fd, thId);
 }
 
 
@@ -276,16 +322,17 @@ TestServer::InitOnEventBase(const std::string& addrStr,
 {
    auto evb = follib_get_evb();
    auto addr = SocketAddress(addrStr, port);
+   auto& acceptSock = acceptSocks_[follib_get_mgr_idx()];
 
    printf("%u: init server at %s:%u\n",
           follib_get_mgr_idx(), addrStr.c_str(), port);
 
-   acceptSock_ = AsyncServerSocket::newSocket(evb);
+   acceptSock = AsyncServerSocket::newSocket(evb);
 
    try {
-      acceptSock_->setReusePortEnabled(true);
-      acceptSock_->bind(addr);
-      acceptSock_->listen(10);
+      acceptSock->setReusePortEnabled(true);
+      acceptSock->bind(addr);
+      acceptSock->listen(10);
 
       /*
        * IIUC the reason addAcceptCallback() takes an event base as input, is
@@ -296,15 +343,15 @@ TestServer::InitOnEventBase(const std::string& addrStr,
        * base as the one where acceptSock_ is located. This way *we* get to
        * decide where the connection is handled.
        */
-      acceptSock_->addAcceptCallback(this, evb);
-      acceptSock_->startAccepting();
+      acceptSock->addAcceptCallback(this, evb);
+      acceptSock->startAccepting();
    } catch (const std::system_error& ex) {
-      acceptSock_.reset();
+      acceptSock.reset();
       int err = ex.code().value();
       printf("Failed to start accept socket: %s (%d)\n", ex.what(), err);
       return err;
    } catch (const std::exception& ex) {
-      acceptSock_.reset();
+      acceptSock.reset();
       printf("Failed to start accept socket: %s\n", ex.what());
       return EINVAL;
    }
@@ -313,53 +360,93 @@ TestServer::InitOnEventBase(const std::string& addrStr,
 }
 
 
+int
+TestServer::InitOnManager(uint32_t           thId,
+                          const std::string& addrStr,
+                          uint16_t           port)
+{
+   int err = 0;
+
+   follib_run_on_manager_sync(thId, [&]() {
+      err = InitOnEventBase(addrStr, port);
+   });
+
+   return err;
+}
+
+
 int
 TestServer::StartAccept(const char *addrStr,
                         uint16_t    port,
                         uint32_t    threadId)
 {
-   folly::fibers::Baton baton;
    printf("start accept %s:%u on thread %u\n", addrStr, port, threadId);
 
-   std::string addrString = addrStr;
-   auto evb = follib_get_evb(threadId);
-   int err = 0;
+   acceptSocks_.resize(follib_get_num_managers());
+   acceptLocal_ = false;
 
-   evb->runInEventBaseThread([&]() {
-      err = InitOnEventBase(addrStr, port);
-      baton.post();
-    });
+   /*
+    * Keep the connections off the first two managers: the main thread and
+    * the one test_server() accepts on.
+    */
+   placer_ = follib_placer_create(connPlacement, 2);
+
+   return InitOnManager(threadId, addrStr, port);
+}
 
-   baton.wait();
 
-   return err;
+/*
+ * TestServer::StartAcceptAll --
+ *
+ *      Have every manager bind its own SO_REUSEPORT socket on the port. The
+ *      kernel hashes each new connection to one of them, and the manager
+ *      that accepts it hosts it: no cross-thread handoff per connection.
+ */
+int
+TestServer::StartAcceptAll(const char *addrStr,
+                           uint16_t    port)
+{
+   const uint32_t n = follib_get_num_managers();
+
+   printf("start accept %s:%u on all %u threads\n", addrStr, port, n);
+
+   acceptSocks_.resize(n);
+   acceptLocal_ = true;
+
+   for (uint32_t i = 0; i < n; i++) {
+      int err = InitOnManager(i, addrStr, port);
+
+      if (err != 0) {
+         StopAccept();
+         return err;
+      }
+   }
+   return 0;
 }
 
 
 void
 TestServer::ExitOnEventBase()
 {
+   auto& acceptSock = acceptSocks_[follib_get_mgr_idx()];
+
    printf("%u: stopping server on event base\n", follib_get_mgr_idx());
 
-   acceptSock_->removeAcceptCallback(this, follib_get_evb());
-   acceptSock_.reset();
+   acceptSock->removeAcceptCallback(this, follib_get_evb());
+   acceptSock.reset();
 }
 
 
 void
 TestServer::StopAccept()
 {
-   folly::fibers::Baton baton;
-
    printf("stopping accept server\n");
 
-   auto evb = acceptSock_->getEventBase();
-   evb->runInEventBaseThread([&]() {
-      ExitOnEventBase();
-      baton.post();
-   });
-
-   baton.wait();
+   for (uint32_t i = 0; i < acceptSocks_.size(); i++) {
+      if (acceptSocks_[i]) {
+         follib_run_on_manager_sync(i, [this]() { ExitOnEventBase(); });
+      }
+   }
    printf("server accept stopped\n");
 }
 
@@ -371,12 +458,19 @@ TestServer::Exit()
 
    StopAccept();
 
-   mutex_.lock();
-   for (auto p : connMap_) {
-      StopConn(p.second);
+   /*
+    * Each manager stops the connections it hosts.
+    */
+   for (uint32_t i = 0; i < follib_get_num_managers(); i++) {
+      follib_run_on_manager_sync(i, [this]() {
+         conns_.drain_local([this](std::shared_ptr<TestConn> conn) {
+            if (placer_) {
+               follib_place_release(placer_, conn->GetThreadId());
+            }
+            conn->StopWork();
+         });
+      });
    }
-   connMap_.clear();
-   mutex_.unlock();
 }
 
 
@@ -390,7 +484,9 @@ test_server()
    {
       auto server = std::make_shared<TestServer>();
 
-      auto res = server->StartAccept("127.0.0.1", 1666, 1 /* thread #0 */);
+      auto res = acceptOnAllManagers ?
+                 server->StartAcceptAll("127.0.0.1", 1666) :
+                 server->StartAccept("127.0.0.1", 1666, 1 /* thread #0 */);
       if (res != 0) {
          goto done;
       }
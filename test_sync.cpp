@@ -0,0 +1,134 @@
+#include <atomic>
+#include <chrono>
+
+#include <folly/SharedMutex.h>
+#include <folly/fibers/Baton.h>
+
+#include "follib.h"
+#include "follib_sync.h"
+#include "test_sync.h"
+
+/*
+ * Read-mostly contention benchmark: every manager runs the same number of
+ * fibers that take a lock for reading in a tight loop and for writing every
+ * so often.
+ */
+
+typedef folly::SharedMutexImpl<true> DSharedMutexReadPriority;
+
+static const uint32_t kFibsPerMgr = 8;
+static const uint32_t kNumIters   = 100000;
+static const uint32_t kWriteEvery = 1000;
+
+static struct {
+   uint64_t value;
+   uint64_t readSum;
+} syncState;
+
+
+static inline void test_rd_lock(DSharedMutexReadPriority *l)   { l->lock_shared(); }
+static inline void test_rd_unlock(DSharedMutexReadPriority *l) { l->unlock_shared(); }
+static inline void test_wr_lock(DSharedMutexReadPriority *l)   { l->lock(); }
+static inline void test_wr_unlock(DSharedMutexReadPriority *l) { l->unlock(); }
+
+static inline void test_rd_lock(follib_rw_lock *l)   { follib_rw_lock_rd_lock(l); }
+static inline void test_rd_unlock(follib_rw_lock *l) { follib_rw_lock_rd_unlock(l); }
+static inline void test_wr_lock(follib_rw_lock *l)   { follib_rw_lock_wr_lock(l); }
+static inline void test_wr_unlock(follib_rw_lock *l) { follib_rw_lock_wr_unlock(l); }
+
+static inline void test_rd_lock(follib_sharded_rw_lock *l)   { follib_sharded_rw_lock_rd_lock(l); }
+static inline void test_rd_unlock(follib_sharded_rw_lock *l) { follib_sharded_rw_lock_rd_unlock(l); }
+static inline void test_wr_lock(follib_sharded_rw_lock *l)   { follib_sharded_rw_lock_wr_lock(l); }
+static inline void test_wr_unlock(follib_sharded_rw_lock *l) { follib_sharded_rw_lock_wr_unlock(l); }
+
+
+template <typename Lock>
+static void
+test_sync_worker(Lock *lock)
+{
+   uint64_t sum = 0;
+
+   for (uint32_t i = 1; i <= kNumIters; i++) {
+      if (i % kWriteEvery == 0) {
+         test_wr_lock(lock);
+         syncState.value++;
+         test_wr_unlock(lock);
+      } else {
+         test_rd_lock(lock);
+         sum += syncState.value;
+         test_rd_unlock(lock);
+      }
+   }
+   __atomic_fetch_add(&syncState.readSum, sum, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Run the workers on all the managers and wait for the last one. Runs on a
+ * fiber of manager 0.
+ */
+template <typename Lock>
+static void
+test_sync_bench(const char *name,
+                Lock       *lock)
+{
+   const uint32_t numFibs = follib_get_num_managers() * kFibsPerMgr;
+   std::atomic<uint32_t> remaining{numFibs};
+   folly::fibers::Baton done;
+
+   syncState.value = 0;
+   auto start = std::chrono::steady_clock::now();
+
+   follib_spawn_in_all_managers(kFibsPerMgr, [&](uint32_t) {
+      test_sync_worker(lock);
+      if (remaining.fetch_sub(1) == 1) {
+         done.post();
+      }
+   });
+   done.wait();
+
+   auto elapsed = std::chrono::steady_clock::now() - start;
+   double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+   printf("%-26s %u fibers: %8.1f ns/op (%lu writes)\n", name, numFibs,
+          ns / ((double)numFibs * kNumIters), syncState.value);
+}
+
+
+static void
+test_sync_fiber()
+{
+   DSharedMutexReadPriority sharedMutex;
+   follib_rw_lock rwLock;
+   follib_rw_lock rwLockWrPrio;
+   follib_sharded_rw_lock shardedLock;
+
+   follib_rw_lock_init(&rwLock);
+   follib_rw_lock_init(&rwLockWrPrio, FOLLIB_RW_LOCK_PRIO_WRITE);
+   follib_sharded_rw_lock_init(&shardedLock);
+
+   test_sync_bench("DSharedMutexReadPriority", &sharedMutex);
+   test_sync_bench("follib_rw_lock", &rwLock);
+   test_sync_bench("follib_rw_lock (wr prio)", &rwLockWrPrio);
+   test_sync_bench("follib_sharded_rw_lock", &shardedLock);
+
+   follib_sharded_rw_lock_exit(&shardedLock);
+   follib_rw_lock_exit(&rwLockWrPrio);
+   follib_rw_lock_exit(&rwLock);
+}
+
+
+void
+test_sync()
+{
+   printf("----- %s -----\n", __func__);
+   follib_init();
+
+   follib_get_manager(0)->addTask([]() { test_sync_fiber(); });
+
+   follib_run_loop_until_no_ready();
+
+   follib_quiesce();
+
+   follib_exit();
+}
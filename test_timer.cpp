@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <folly/Random.h>
+#include <folly/fibers/Baton.h>
+#include <folly/io/async/AsyncSocket.h>
+
+#include "follib.h"
+#include "follib_buf.h"
+#include "follib_hist.h"
+#include "follib_io.h"
+#include "follib_net.h"
+#include "follib_timer.h"
+#include "test_timer.h"
+
+/*
+ * Timer and deadline demo, all on manager 0:
+ *  - arm and cancel 100k timers, and see how much fibers oversleep while
+ *    they're all armed;
+ *  - flood the i/o engine with reads carrying a short timeout, the ones
+ *    stuck in the admission queue get shed;
+ *  - time out a socket read nobody answers.
+ */
+
+static const uint32_t kTimerNumArmed    = 100000;
+static const uint32_t kTimerNumSleepers = 1000;
+static const uint32_t kTimerNumSleeps   = 20;
+
+static struct {
+   const char *fileName{"/tmp/multi_timer.dat"};
+   int         fileFd{-1};
+   size_t      fileSize{64 * 1024 * 1024};
+   uint32_t    ioSize{1024 * 1024};
+   uint32_t    numIOs{256};
+   uint32_t    ioTimeoutMs{5};
+} timerState;
+
+
+struct test_timer_cb : public folly::HHWheelTimer::Callback {
+   void timeoutExpired() noexcept override { numFired++; }
+   void callbackCanceled() noexcept override { }
+
+   static uint64_t numFired;
+};
+
+uint64_t test_timer_cb::numFired = 0;
+
+
+static double
+test_timer_ns_since(std::chrono::steady_clock::time_point start)
+{
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+
+/*
+ * test_timer_sleepers --
+ *
+ *      Run fibers that sleep for random durations and record by how much
+ *      they overslept, in us.
+ */
+static void
+test_timer_sleepers(follib_hist *hist)
+{
+   folly::fibers::Baton done;
+   uint32_t remaining = kTimerNumSleepers;
+
+   for (uint32_t i = 0; i < kTimerNumSleepers; i++) {
+      follib_get_manager()->addTask([&]() {
+         for (uint32_t j = 0; j < kTimerNumSleeps; j++) {
+            const uint64_t us = folly::Random::rand32(1, 20) * 1000;
+            auto start = std::chrono::steady_clock::now();
+            uint64_t slept;
+
+            follib_sleep_for(std::chrono::milliseconds(us / 1000));
+            slept = test_timer_ns_since(start) / 1000;
+            follib_hist_record(hist, slept > us ? slept - us : 0);
+         }
+         if (--remaining == 0) {
+            done.post();
+         }
+      });
+   }
+   done.wait();
+}
+
+
+static void
+test_timer_wheel()
+{
+   std::vector<test_timer_cb> cbs(kTimerNumArmed);
+   std::unique_ptr<follib_hist> hist(new follib_hist);
+   folly::HHWheelTimer *timer = follib_get_timer();
+   double ns;
+
+   auto start = std::chrono::steady_clock::now();
+   for (auto& cb : cbs) {
+      timer->scheduleTimeout(&cb, std::chrono::milliseconds(
+                                     folly::Random::rand32(10000, 60000)));
+   }
+   ns = test_timer_ns_since(start);
+   printf("armed %u timers: %.1f ns each, %zu pending\n",
+          kTimerNumArmed, ns / kTimerNumArmed, timer->count());
+
+   follib_hist_reset(hist.get());
+   test_timer_sleepers(hist.get());
+   follib_hist_print(hist.get(), "oversleep us, 100k timers armed");
+
+   start = std::chrono::steady_clock::now();
+   for (auto& cb : cbs) {
+      cb.cancelTimeout();
+   }
+   ns = test_timer_ns_since(start);
+   printf("cancelled %u timers: %.1f ns each, %lu fired\n",
+          kTimerNumArmed, ns / kTimerNumArmed, test_timer_cb::numFired);
+
+   follib_hist_reset(hist.get());
+   test_timer_sleepers(hist.get());
+   follib_hist_print(hist.get(), "oversleep us, no timer armed");
+}
+
+
+static bool
+test_timer_prepare_file()
+{
+   const size_t chunk = 1024 * 1024;
+   std::vector<uint8_t> buf(chunk, 0xa5);
+   int fd;
+
+   fd = ::open(timerState.fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      printf("failed to open '%s': %s\n", timerState.fileName, strerror(errno));
+      return false;
+   }
+   for (size_t off = 0; off < timerState.fileSize; off += chunk) {
+      if (pwrite(fd, buf.data(), chunk, off) != (ssize_t)chunk) {
+         printf("failed to write: %s\n", strerror(errno));
+         close(fd);
+         return false;
+      }
+   }
+   fsync(fd);
+   close(fd);
+
+   timerState.fileFd = ::open(timerState.fileName, O_RDONLY | O_DIRECT);
+   return timerState.fileFd >= 0;
+}
+
+
+/*
+ * test_timer_io --
+ *
+ *      Issue many more large reads at once than the engine takes, each with
+ *      a short timeout.
+ */
+static void
+test_timer_io()
+{
+   const uint32_t numChunks = timerState.fileSize / timerState.ioSize;
+   folly::fibers::Baton done;
+   uint32_t remaining = timerState.numIOs;
+   uint32_t numOk = 0;
+   uint32_t numTimedOut = 0;
+   uint32_t numFailed = 0;
+
+   if (!test_timer_prepare_file()) {
+      return;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (uint32_t i = 0; i < timerState.numIOs; i++) {
+      follib_get_manager()->addTask([&, i]() {
+         follib_buf buf(timerState.ioSize);
+         const uint64_t off = (uint64_t)(i % numChunks) * timerState.ioSize;
+
+         if (follib_pread_timeout(timerState.fileFd, off, timerState.ioSize,
+                                  buf.data(),
+                                  std::chrono::milliseconds(timerState.ioTimeoutMs))) {
+            numOk++;
+         } else if (errno == ETIMEDOUT) {
+            numTimedOut++;
+         } else {
+            numFailed++;
+         }
+         if (--remaining == 0) {
+            done.post();
+         }
+      });
+   }
+   done.wait();
+
+   printf("%u reads of %u KB, %u ms timeout: %u ok, %u timed out, %u failed "
+          "in %.1f ms\n", timerState.numIOs, timerState.ioSize / 1024,
+          timerState.ioTimeoutMs, numOk, numTimedOut, numFailed,
+          test_timer_ns_since(start) / 1000000);
+
+   close(timerState.fileFd);
+   timerState.fileFd = -1;
+   unlink(timerState.fileName);
+}
+
+
+/*
+ * test_timer_socket --
+ *
+ *      Read from a socket whose peer never writes.
+ */
+static void
+test_timer_socket()
+{
+   FiberSocketReader reader;
+   char byte;
+   int fds[2];
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      printf("%s: socketpair: %s\n", __func__, strerror(errno));
+      return;
+   }
+
+   auto sock = folly::AsyncSocket::newSocket(follib_get_evb(), fds[0]);
+   reader.Attach(sock.get());
+
+   auto start = std::chrono::steady_clock::now();
+   ssize_t res = Follib_ReadTimeout(&reader, &byte, 1, std::chrono::milliseconds(50));
+
+   printf("socket read: %zd (%s) after %.1f ms\n", res,
+          res < 0 ? strerror(errno) : "ok", test_timer_ns_since(start) / 1000000);
+
+   sock->close();
+   sock.reset();
+   close(fds[1]);
+}
+
+
+void
+test_timer()
+{
+   printf("----- %s -----\n", __func__);
+
+   follib_init();
+
+   follib_get_manager(0)->addTask([]() {
+      test_timer_wheel();
+      test_timer_io();
+      test_timer_socket();
+   });
+   follib_run_loop_until_no_ready();
+
+   follib_quiesce();
+   follib_exit();
+}